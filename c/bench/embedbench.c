@@ -0,0 +1,126 @@
+// measures what one evaluation costs an embedder: handing interpret()
+// a small source every time, against compiling the script once and
+// calling its functions through callFunction()
+
+// clock_gettime is posix, not c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../vm.h"
+
+static const char* script =
+    "fun add(a, b) { return a + b; }\n"
+    "fun hypot(x, y) { return sqrt(x * x + y * y); }\n"
+    "fun greet(name) { return \"hello \" + name; }\n"
+    "print \"loaded\";\n";
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static Value sqrtNative(VM* vm, int argCount, Value* args) {
+  return NUMBER_VAL(IS_NUMBER(args[0]) ? sqrt(AS_NUMBER(args[0])) : 0);
+}
+
+static void fail(const char* what) {
+  fprintf(stderr, "%s failed\n", what);
+  exit(70);
+}
+
+static Value function(VM* vm, const char* name) {
+  Value value;
+  if (!getGlobal(vm, name, &value)) fail(name);
+  return value;
+}
+
+static void report(const char* name, int calls, double seconds) {
+  printf("%-22s %9d calls %9.1f ns/call\n", name, calls,
+         seconds * 1e9 / calls);
+}
+
+int main(int argc, const char* argv[]) {
+  // embedbench [calls]
+  int calls = argc > 1 ? atoi(argv[1]) : 2000000;
+  if (calls < 1) {
+    fprintf(stderr, "Usage: embedbench [calls]\n");
+    return 64;
+  }
+
+  VM vm;
+  initVM(&vm);
+  defineNative(&vm, "sqrt", 1, sqrtNative);
+
+  // print statements go to the sink, here a temporary file
+  vm.output = tmpfile();
+  if (vm.output == NULL) fail("tmpfile");
+  ObjClosure* handle = loadScript(&vm, "bench", script);
+  if (handle == NULL || runScript(&vm, handle) != INTERPRET_OK) fail("script");
+
+  char printed[16] = {0};
+  rewind(vm.output);
+  if (fgets(printed, sizeof(printed), vm.output) == NULL ||
+      strcmp(printed, "loaded\n") != 0) {
+    fail("output sink");
+  }
+  fclose(vm.output);
+  vm.output = stdout;
+
+  // the old way, a source compiled and run for every evaluation
+  int interprets = calls / 20 < 1 ? 1 : calls / 20;
+  double begin = now();
+  for (int i = 0; i < interprets; i++) {
+    if (interpret(&vm, "var r = add(1, 2);") != INTERPRET_OK) fail("interpret");
+  }
+  report("interpret add(1, 2)", interprets, now() - begin);
+
+  Value add = function(&vm, "add");
+  double sum = 0;
+  begin = now();
+  for (int i = 0; i < calls; i++) {
+    Value result;
+    push(&vm, add);
+    push(&vm, NUMBER_VAL(i));
+    push(&vm, NUMBER_VAL(1));
+    if (callFunction(&vm, 2, &result) != INTERPRET_OK) fail("add");
+    sum += AS_NUMBER(result);
+  }
+  report("callFunction add", calls, now() - begin);
+  if (sum != (double)calls * (calls + 1) / 2) fail("add result");
+
+  Value hypot = function(&vm, "hypot");
+  begin = now();
+  for (int i = 0; i < calls; i++) {
+    Value result;
+    push(&vm, hypot);
+    push(&vm, NUMBER_VAL(3));
+    push(&vm, NUMBER_VAL(4));
+    if (callFunction(&vm, 2, &result) != INTERPRET_OK ||
+        AS_NUMBER(result) != 5) {
+      fail("hypot");
+    }
+  }
+  report("callFunction hypot", calls, now() - begin);
+
+  // an argument made in c is pushed before anything else allocates
+  Value greet = function(&vm, "greet");
+  begin = now();
+  for (int i = 0; i < calls; i++) {
+    Value result;
+    push(&vm, greet);
+    push(&vm, OBJ_VAL(copyString(&vm, "world", 5)));
+    if (callFunction(&vm, 1, &result) != INTERPRET_OK || !IS_STRING(result)) {
+      fail("greet");
+    }
+  }
+  report("callFunction greet", calls, now() - begin);
+
+  freeVM(&vm);
+  return 0;
+}
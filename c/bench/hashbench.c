@@ -0,0 +1,166 @@
+// compares the string hashes in hash.c: throughput over strings of
+// different lengths, and how well the hashes spread keys across an
+// intern table that grows and probes the way table.c does
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../hash.h"
+
+#define TABLE_MAX_LOAD 0.75
+#define KEY_COUNT 200000
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+typedef struct {
+  const char* name;
+  HashFn function;
+} Hash;
+
+static Hash hashes[] = {
+  {"fnv1a", hashFnv},
+  {"words", hashWords},
+};
+
+#define HASH_COUNT ((int)(sizeof(hashes) / sizeof(hashes[0])))
+
+typedef struct {
+  int count;
+  char** keys;
+  int* lengths;
+} KeySet;
+
+static void addKey(KeySet* set, const char* key) {
+  int length = (int)strlen(key);
+  set->keys[set->count] = malloc(length + 1);
+  memcpy(set->keys[set->count], key, length + 1);
+  set->lengths[set->count] = length;
+  set->count++;
+}
+
+static void makeKeys(KeySet* set, int kind) {
+  set->count = 0;
+  set->keys = malloc(sizeof(char*) * KEY_COUNT);
+  set->lengths = malloc(sizeof(int) * KEY_COUNT);
+
+  char buffer[128];
+  for (int i = 0; i < KEY_COUNT; i++) {
+    switch (kind) {
+      case 0: snprintf(buffer, sizeof(buffer), "name%d", i); break;
+      case 1: snprintf(buffer, sizeof(buffer), "%d", i * 8); break;
+      default:
+        snprintf(buffer, sizeof(buffer),
+                 "2024-03-01 12:%02d:%02d INFO request id=%d path=/items/%d",
+                 i / 60 % 60, i % 60, i, i % 997);
+        break;
+    }
+    addKey(set, buffer);
+  }
+}
+
+static void freeKeys(KeySet* set) {
+  for (int i = 0; i < set->count; i++) free(set->keys[i]);
+  free(set->keys);
+  free(set->lengths);
+}
+
+static int compareHashes(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// inserts every key into an open addressed table with linear probing,
+// growing it from 8 slots by doubling like adjustCapacity() does
+static void measureTable(HashFn hash, KeySet* set) {
+  uint32_t* hashed = malloc(sizeof(uint32_t) * set->count);
+  for (int i = 0; i < set->count; i++) {
+    hashed[i] = hash(set->keys[i], set->lengths[i]);
+  }
+
+  int capacity = 0;
+  int count = 0;
+  int32_t* slots = NULL;
+  long probes = 0;
+  for (int i = 0; i < set->count; i++) {
+    if (count + 1 > capacity * TABLE_MAX_LOAD) {
+      int oldCapacity = capacity;
+      int32_t* old = slots;
+      capacity = capacity < 8 ? 8 : capacity * 2;
+      slots = malloc(sizeof(int32_t) * capacity);
+      for (int j = 0; j < capacity; j++) slots[j] = -1;
+      for (int j = 0; j < oldCapacity; j++) {
+        if (old[j] < 0) continue;
+        uint32_t index = hashed[old[j]] & (capacity - 1);
+        while (slots[index] >= 0) index = (index + 1) & (capacity - 1);
+        slots[index] = old[j];
+      }
+      free(old);
+    }
+
+    // the probe a lookup of this key will repeat later
+    uint32_t index = hashed[i] & (capacity - 1);
+    probes++;
+    while (slots[index] >= 0) {
+      index = (index + 1) & (capacity - 1);
+      probes++;
+    }
+    slots[index] = i;
+    count++;
+  }
+
+  qsort(hashed, set->count, sizeof(uint32_t), compareHashes);
+  int collisions = 0;
+  for (int i = 1; i < set->count; i++) {
+    if (hashed[i] == hashed[i - 1]) collisions++;
+  }
+
+  printf("  %6.3f probes/key  %5d full collisions\n",
+         (double)probes / set->count, collisions);
+  free(slots);
+  free(hashed);
+}
+
+static void measureThroughput(HashFn hash, int length) {
+  int size = 1 << 16;
+  char* buffer = malloc(size + length);
+  for (int i = 0; i < size + length; i++) buffer[i] = (char)(i * 31 + 7);
+
+  // hash the same total number of bytes at every length
+  long total = 256L << 20;
+  long calls = total / length;
+  uint32_t sink = 0;
+  clock_t start = clock();
+  for (long i = 0; i < calls; i++) {
+    sink += hash(buffer + (i * 64 & (size - 1)), length);
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("  %5d bytes: %8.1f MB/s %8.1f Mhash/s  (%08x)\n", length,
+         total / seconds / (1 << 20), calls / seconds / 1e6, sink);
+  free(buffer);
+}
+
+int main() {
+  static const char* kinds[] = {"identifiers", "numbers", "log lines"};
+  static const int lengths[] = {4, 8, 16, 32, 64, 256, 4096};
+
+  for (int h = 0; h < HASH_COUNT; h++) {
+    printf("%s\n", hashes[h].name);
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+      measureThroughput(hashes[h].function, lengths[i]);
+    }
+
+    for (int kind = 0; kind < 3; kind++) {
+      KeySet set;
+      makeKeys(&set, kind);
+      printf("  %d %s:", set.count, kinds[kind]);
+      measureTable(hashes[h].function, &set);
+      freeKeys(&set);
+    }
+  }
+
+  return 0;
+}
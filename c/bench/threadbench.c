@@ -0,0 +1,162 @@
+// runs the same script on 1, 2, 4... threads at once, each thread
+// compiling and running it in a VM of its own, and reports how the
+// throughput scales: with nothing shared the wall time should stay flat
+// as long as there are cores for the threads. it then reports what it
+// takes a vm to get ready to run the script, compiling it or starting from
+// the script frozen into a Program once for all vms
+
+// pthread barriers and clock_gettime are posix, not c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../vm.h"
+
+// calls, instances, fields, string building and enough garbage for
+// minor and full collections, but no output
+static const char* script =
+    "fun fib(n) {\n"
+    "  if (n < 2) return n;\n"
+    "  return fib(n - 2) + fib(n - 1);\n"
+    "}\n"
+    "class Point {\n"
+    "  init(x, y) { this.x = x; this.y = y; }\n"
+    "  sum() { return this.x + this.y; }\n"
+    "}\n"
+    "var total = 0;\n"
+    "for (var i = 0; i < 300000; i = i + 1) {\n"
+    "  total = total + Point(i, 1).sum();\n"
+    "}\n"
+    "var s = \"\";\n"
+    "for (var i = 0; i < 2000; i = i + 1) s = s + \"ab\";\n"
+    "total = total + fib(24);\n";
+
+typedef struct {
+  pthread_t thread;
+  pthread_barrier_t* start;
+  int runs;
+  InterpretResult result;
+} Worker;
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void* work(void* argument) {
+  Worker* worker = (Worker*)argument;
+  pthread_barrier_wait(worker->start);
+
+  worker->result = INTERPRET_OK;
+  for (int i = 0; i < worker->runs; i++) {
+    VM vm;
+    initVM(&vm);
+    InterpretResult result = interpret(&vm, script);
+    if (result != INTERPRET_OK) worker->result = result;
+    freeVM(&vm);
+  }
+  return NULL;
+}
+
+// seconds until count threads have each run the script runs times
+static double measure(int count, int runs) {
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, count + 1);
+  Worker* workers = malloc(sizeof(Worker) * count);
+  for (int i = 0; i < count; i++) {
+    workers[i].start = &start;
+    workers[i].runs = runs;
+    pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+  }
+
+  pthread_barrier_wait(&start);
+  double begin = now();
+  for (int i = 0; i < count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    if (workers[i].result != INTERPRET_OK) {
+      fprintf(stderr, "thread %d failed to run the script\n", i);
+      exit(70);
+    }
+  }
+  double seconds = now() - begin;
+
+  free(workers);
+  pthread_barrier_destroy(&start);
+  return seconds;
+}
+
+// seconds per vm to be ready to run the script, and the gc heap it has
+// by then: from source, or from program if it is not NULL
+static double prepare(Program* program, int count, size_t* bytes) {
+  double begin = now();
+  for (int i = 0; i < count; i++) {
+    VM vm;
+    if (program == NULL) {
+      initVM(&vm);
+      if (loadScript(&vm, "bench", script) == NULL) exit(70);
+    } else {
+      initSharedVM(&vm, program);
+      holdScript(&vm, "bench", program->functions[0]);
+    }
+    *bytes = vm.bytesAllocated;
+    freeVM(&vm);
+  }
+  return (now() - begin) / count;
+}
+
+int main(int argc, const char* argv[]) {
+  // threadbench [max threads] [runs per thread]
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int maxThreads = argc > 1 ? atoi(argv[1]) : (cores < 1 ? 1 : cores);
+  int runs = argc > 2 ? atoi(argv[2]) : 3;
+  if (maxThreads < 1 || runs < 1) {
+    fprintf(stderr, "Usage: threadbench [max threads] [runs per thread]\n");
+    return 64;
+  }
+
+  printf("%d cores online, %d runs per thread\n", cores, runs);
+  printf("threads   seconds   scripts/s   speedup   efficiency\n");
+  double single = 0;
+  for (int count = 1;; count *= 2) {
+    if (count > maxThreads) count = maxThreads;
+
+    double seconds = measure(count, runs);
+    double throughput = count * runs / seconds;
+    if (count == 1) single = throughput;
+    printf("%7d %9.3f %11.2f %8.2fx %11.0f%%\n", count, seconds, throughput,
+           throughput / single, 100 * throughput / single / count);
+
+    if (count == maxThreads) break;
+  }
+
+  VM vm;
+  initVM(&vm);
+  ObjClosure* compiled = loadScript(&vm, "bench", script);
+  if (compiled == NULL) return 70;
+  Program* program = freezeProgram(&vm, &compiled->function, 1);
+  freeVM(&vm);
+
+  int vms = 2000;
+  size_t ownBytes, sharedBytes;
+  double own = prepare(NULL, vms, &ownBytes);
+  double shared = prepare(program, vms, &sharedBytes);
+  printf("\nready to run      us/vm   heap bytes/vm\n");
+  printf("compiled      %9.2f %15zu\n", own * 1e6, ownBytes);
+  printf("shared        %9.2f %15zu   + %zu once\n", shared * 1e6,
+         sharedBytes, program->bytes);
+
+  // and the frozen script runs like the compiled one
+  initSharedVM(&vm, program);
+  InterpretResult result =
+      runScript(&vm, holdScript(&vm, "bench", program->functions[0]));
+  freeVM(&vm);
+  freeProgram(program);
+  if (result != INTERPRET_OK) return 70;
+
+  return 0;
+}
@@ -0,0 +1,261 @@
+// mkstemp, fdopen, fcntl locks, utimensat and dirent are posix, not c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "serialize.h"
+#include "vm.h"
+
+#define STATS_NAME "stats"
+#define TEMP_NAME "tmp-XXXXXX"
+
+typedef struct {
+  char* path;
+  uint64_t size;
+  time_t used;
+} CacheFile;
+
+static uint64_t hashSource(const char* source, size_t length) {
+  // 64 bit FNV-1a, so that scripts rarely share an entry name; two that
+  // do only take turns compiling, since a hit compares the whole source
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static char* joinPath(const char* dir, const char* name) {
+  size_t length = strlen(dir) + strlen(name) + 2;
+  char* path = malloc(length);
+  snprintf(path, length, "%s/%s", dir, name);
+  return path;
+}
+
+static bool isCacheFile(const char* name) {
+  // the directory may hold other files, those are never touched
+  size_t length = strlen(name);
+  return (length > 5 && strcmp(name + length - 5, ".loxc") == 0) ||
+         (length == strlen(TEMP_NAME) && strncmp(name, TEMP_NAME, 4) == 0);
+}
+
+static uint64_t cacheLimit() {
+  const char* limit = getenv(CACHE_SIZE_ENV);
+  if (limit == NULL) return CACHE_SIZE_DEFAULT;
+
+  char* end;
+  unsigned long long bytes = strtoull(limit, &end, 10);
+  return end == limit || *end != '\0' ? CACHE_SIZE_DEFAULT : bytes;
+}
+
+static bool readStats(int fd, uint64_t counts[2]) {
+  return pread(fd, counts, 2 * sizeof(uint64_t), 0) ==
+         2 * sizeof(uint64_t);
+}
+
+static void countStat(const char* dir, bool hit) {
+  // the counters are shared by every process using the directory,
+  // so they are only updated under a write lock
+  char* path = joinPath(dir, STATS_NAME);
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  free(path);
+  if (fd < 0) return;
+
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(fd, F_SETLKW, &lock) == 0) {
+    uint64_t counts[2];
+    if (!readStats(fd, counts)) counts[0] = counts[1] = 0;
+    counts[hit ? 0 : 1]++;
+    ssize_t written = pwrite(fd, counts, sizeof(counts), 0);
+    (void)written; // A lost count is not worth failing the script over.
+  }
+  close(fd); // Also releases the lock.
+}
+
+static int listFiles(const char* dir, CacheFile** files, uint64_t* total) {
+  *files = NULL;
+  *total = 0;
+  DIR* directory = opendir(dir);
+  if (directory == NULL) return 0;
+
+  int count = 0;
+  int capacity = 0;
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (!isCacheFile(entry->d_name)) continue;
+
+    char* path = joinPath(dir, entry->d_name);
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+      free(path);
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity < 8 ? 8 : capacity * 2;
+      *files = realloc(*files, sizeof(CacheFile) * capacity);
+    }
+    (*files)[count].path = path;
+    (*files)[count].size = (uint64_t)info.st_size;
+    (*files)[count].used = info.st_mtime;
+    *total += (uint64_t)info.st_size;
+    count++;
+  }
+  closedir(directory);
+  return count;
+}
+
+static void freeFiles(CacheFile* files, int count) {
+  for (int i = 0; i < count; i++) free(files[i].path);
+  free(files);
+}
+
+static int compareUse(const void* a, const void* b) {
+  time_t first = ((const CacheFile*)a)->used;
+  time_t second = ((const CacheFile*)b)->used;
+  return (first > second) - (first < second);
+}
+
+static void evict(const char* dir) {
+  // only done after a miss, hits don't pay for listing the directory
+  CacheFile* files;
+  uint64_t total;
+  int count = listFiles(dir, &files, &total);
+
+  uint64_t limit = cacheLimit();
+  if (total > limit) {
+    qsort(files, count, sizeof(CacheFile), compareUse);
+    for (int i = 0; i < count && total > limit; i++) {
+      if (unlink(files[i].path) == 0) total -= files[i].size;
+    }
+  }
+  freeFiles(files, count);
+}
+
+static ObjFunction* loadEntry(VM* vm, const char* path, const char* source,
+                              size_t length) {
+  // the name only narrows down the source, the entry starts with all of it
+  // and a hit has to match it byte for byte
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat info;
+  if (fstat(fd, &info) < 0 || (size_t)info.st_size <= length) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t)info.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+
+  ObjFunction* function = NULL;
+  if (memcmp(data, source, length) == 0) {
+    function = readBytecode(vm, (const uint8_t*)data + length, size - length);
+  }
+  munmap(data, size);
+  return function;
+}
+
+static void storeEntry(VM* vm, const char* dir, const char* path,
+                       const char* source, size_t length,
+                       ObjFunction* function) {
+  // renaming the whole file over the entry is atomic, so a process loading
+  // it at the same time sees the old entry, no entry, or the new one;
+  // an entry torn by a crash fails its checksum and is compiled again
+  char* temp = joinPath(dir, TEMP_NAME);
+  int fd = mkstemp(temp);
+  if (fd < 0) {
+    free(temp);
+    return;
+  }
+
+  FILE* file = fdopen(fd, "wb");
+  bool written = false;
+  if (file == NULL) {
+    close(fd);
+  } else {
+    written = fwrite(source, 1, length, file) == length &&
+              writeBytecode(vm, function, file);
+    written = fclose(file) == 0 && written;
+  }
+  if (!written || rename(temp, path) != 0) unlink(temp);
+  free(temp);
+
+  evict(dir);
+}
+
+ObjFunction* compileCached(VM* vm, const char* dir, const char* source) {
+  // the directory is made on first use, if that fails every
+  // lookup misses and the script is simply compiled
+  mkdir(dir, 0777);
+
+  // the version is part of the name, so entries of other versions
+  // are never loaded, only evicted over time
+  size_t length = strlen(source);
+  char name[64];
+  snprintf(name, sizeof(name), "v%d-%016" PRIx64 "-%zx.loxc",
+           BYTECODE_VERSION, hashSource(source, length), length);
+  char* path = joinPath(dir, name);
+
+  ObjFunction* function = loadEntry(vm, path, source, length);
+  if (function != NULL) {
+    // the modification time is when the entry was last used
+    utimensat(AT_FDCWD, path, NULL, 0);
+    countStat(dir, true);
+    free(path);
+    return function;
+  }
+
+  countStat(dir, false);
+  function = compile(vm, source);
+  if (function != NULL) {
+    push(vm, OBJ_VAL(function));
+    storeEntry(vm, dir, path, source, length, function);
+    pop(vm);
+  }
+  free(path);
+  return function;
+}
+
+void printCacheStats(const char* dir) {
+  uint64_t counts[2] = {0, 0};
+  char* path = joinPath(dir, STATS_NAME);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd >= 0) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLKW, &lock) != 0 || !readStats(fd, counts)) {
+      counts[0] = counts[1] = 0;
+    }
+    close(fd);
+  }
+
+  CacheFile* files;
+  uint64_t total;
+  int count = listFiles(dir, &files, &total);
+  freeFiles(files, count);
+
+  printf("hits %" PRIu64 "\n", counts[0]);
+  printf("misses %" PRIu64 "\n", counts[1]);
+  printf("entries %d\n", count);
+  printf("bytes %" PRIu64 " of %" PRIu64 "\n", total, cacheLimit());
+}
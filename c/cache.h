@@ -0,0 +1,27 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+
+// an on disk cache of compiled scripts, used by runFile() when
+// LOX_CACHE_DIR names a directory (created if missing):
+//   v<version>-<hash>-<length>.loxc  the source of a script, then what
+//                                     writeBytecode() made of it; only an
+//                                     entry whose source matches is loaded
+//   stats                             u64 hits, u64 misses
+// entries are written to a temporary file and renamed into place, so other
+// processes sharing the directory never see half an entry; once the entries
+// add up to more than LOX_CACHE_SIZE bytes (64MB by default) the ones least
+// recently used are removed
+#define CACHE_DIR_ENV "LOX_CACHE_DIR"
+#define CACHE_SIZE_ENV "LOX_CACHE_SIZE"
+#define CACHE_SIZE_DEFAULT (64 * 1024 * 1024)
+
+// compiles source like compile(), but loads the function from the cache if
+// the same source was compiled before; an entry that fails to load is
+// compiled again and replaced, the cache never makes a script fail
+ObjFunction* compileCached(VM* vm, const char* dir, const char* source);
+void printCacheStats(const char* dir);
+
+#endif
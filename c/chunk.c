@@ -8,35 +8,377 @@ void initChunk(Chunk* chunk) {
   chunk->count = 0;           
   chunk->capacity = 0;        
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;  
   initValueArray(&chunk->constants);        
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
 } 
 
-void freeChunk(Chunk* chunk) {                      
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  freeValueArray(&chunk->constants);  
+void freeChunk(VM* vm, Chunk* chunk) {                      
+  FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+  freeValueArray(vm, &chunk->constants);  
+  FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);                                 
 }   
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {     
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {     
   if (chunk->capacity < chunk->count + 1) {       
     int oldCapacity = chunk->capacity;            
     chunk->capacity = GROW_CAPACITY(oldCapacity); 
-    chunk->code = GROW_ARRAY(chunk->code, uint8_t,
+    chunk->code = GROW_ARRAY(vm, chunk->code, uint8_t,
         oldCapacity, chunk->capacity); 
-    chunk->lines = GROW_ARRAY(chunk->lines, int,  
-        oldCapacity, chunk->capacity);              
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;               
+  addLine(vm, chunk, chunk->count, line);
   chunk->count++;                                 
 }  
 
-int addConstant(Chunk* chunk, Value value) {
-  push(value);
-  writeValueArray(&chunk->constants, value);
-  pop();
+void addLine(VM* vm, Chunk* chunk, int offset, int line) {
+  // offsets only grow, so a new entry is needed only when the line changes
+  if (chunk->lineCount > 0 &&
+      chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(vm, chunk->lines, LineStart,
+        oldCapacity, chunk->lineCapacity);
+  }
+
+  chunk->lines[chunk->lineCount].offset = offset;
+  chunk->lines[chunk->lineCount].line = line;
+  chunk->lineCount++;
+}
+
+int getLine(Chunk* chunk, int offset) {
+  // binary search for the last run starting at or before offset
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  while (low < high) {
+    int middle = low + (high - low + 1) / 2;
+    if (chunk->lines[middle].offset <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return chunk->lines[low].line;
+}
+
+void truncateChunk(Chunk* chunk, int count) {
+  // drop the code from count on, along with the runs that start there
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+  push(vm, value);
+  writeValueArray(vm, &chunk->constants, value);
+  pop(vm);
   return chunk->constants.count - 1;        
-}  
\ No newline at end of file
+}
+
+int addInlineCache(VM* vm, Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(vm, chunk->caches, InlineCache,
+        oldCapacity, chunk->cacheCapacity);
+  }
+
+  chunk->caches[chunk->cacheCount].count = 0;
+  return chunk->cacheCount++;
+}
+
+static int readOperand(uint8_t* code, int width) {
+  int operand = 0;
+  for (int i = 0; i < width; i++) operand = (operand << 8) | code[i];
+  return operand;
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+  switch ((OpCode)chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_ADD_CONST:
+      return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SUPER_INVOKE:
+    case OP_ADD_LOCAL_CONST:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+      return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+      return 4;
+    case OP_INVOKE:
+    case OP_GET_LOCAL_GET_PROPERTY:
+    case OP_SUPER_INVOKE_LONG:
+      return 5;
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+      return 6;
+    case OP_INVOKE_LONG:
+      return 7;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      // each captured variable adds a CaptureKind byte and its index; a
+      // capture cut off by the end of the code makes it run past the end
+      int width = chunk->code[offset] == OP_CLOSURE ? 1 : 3;
+      ObjFunction* function = AS_FUNCTION(
+          chunk->constants.values[readOperand(chunk->code + offset + 1,
+                                              width)]);
+      int end = offset + 1 + width;
+      for (int i = 0; i < function->upvalueCount; i++) {
+        if (end >= chunk->count) return end - offset + 1;
+        end += chunk->code[end] == CAPTURE_LOCAL_LONG ? 4 : 2;
+      }
+      return end - offset;
+    }
+    default:
+      return 1;
+  }
+}
+
+bool stackEffect(Chunk* chunk, int offset, StackEffect* effect) {
+  // false if offset doesn't hold an opcode
+  uint8_t* code = chunk->code;
+  uint8_t* operands = code + offset + 1;
+  int length = instructionLength(chunk, offset);
+  int pops = 0;
+  int pushes = 0;
+  // the vm may push one object it has just made, an interned string, a new
+  // shape or what a native allocates, to keep it alive while it is linked in
+  int temporaries = 1;
+  effect->local = -1;
+  effect->jumps = false;
+  effect->falls = true;
+
+  switch (code[offset]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_UPVALUE:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      pushes = 1;
+      break;
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      pops = 1;
+      break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_INHERIT:
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+      pops = 2;
+      pushes = 1;
+      break;
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+      // the instance or class stays, the superclass or method goes
+      pops = 2;
+      pushes = 1;
+      break;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_SET_UPVALUE:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+      pops = pushes = 1;
+      break;
+    case OP_ADD_CONST:
+      // pushes the constant before it goes the way of OP_ADD
+      pops = pushes = 1;
+      temporaries = 2;
+      break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      pushes = 1;
+      effect->local = readOperand(operands, length - 1);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      pops = pushes = 1;
+      effect->local = readOperand(operands, length - 1);
+      break;
+    case OP_GET_LOCAL_GET_PROPERTY:
+      pushes = 1;
+      effect->local = operands[0];
+      break;
+    case OP_ADD_LOCAL_CONST:
+      // pushes the local and the constant before it goes the way of OP_ADD
+      effect->local = operands[0];
+      temporaries = 3;
+      break;
+    case OP_CALL:
+      pops = operands[0] + 1;
+      pushes = 1;
+      break;
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+      pops = operands[length - 4] + 1;
+      pushes = 1;
+      break;
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:
+      pops = operands[length - 2] + 2;
+      pushes = 1;
+      break;
+    case OP_JUMP:
+      effect->falls = false;
+      effect->target = offset + 3 + readOperand(operands, 2);
+      effect->jumps = true;
+      break;
+    case OP_JUMP_IF_FALSE:
+      pops = pushes = 1;
+      effect->target = offset + 3 + readOperand(operands, 2);
+      effect->jumps = true;
+      break;
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+      pops = 2;
+      effect->target = offset + 3 + readOperand(operands, 2);
+      effect->jumps = true;
+      break;
+    case OP_LOOP:
+      effect->falls = false;
+      effect->target = offset + 3 - readOperand(operands, 2);
+      effect->jumps = true;
+      break;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      // a capture from this function's slots names the slot
+      pushes = 1;
+      for (int i = code[offset] == OP_CLOSURE ? 1 : 3; i < length - 1;) {
+        int width = operands[i] == CAPTURE_LOCAL_LONG ? 3 : 1;
+        int index = readOperand(operands + i + 1, width);
+        if (operands[i] != CAPTURE_UPVALUE && index > effect->local) {
+          effect->local = index;
+        }
+        i += 1 + width;
+      }
+      break;
+    case OP_RETURN:
+      pops = 1;
+      effect->falls = false;
+      break;
+    default:
+      return false;
+  }
+
+  effect->pops = pops;
+  effect->pushes = pushes;
+  effect->peak = (pushes > pops ? pushes - pops : 0) + temporaries;
+  return true;
+}
+
+// where maxStackDepth has been and still has to go
+typedef struct {
+  int count;
+  int* heights;   // the stack height at each offset, -1 until something
+                  // reaches it and -2 where no instruction starts
+  int* pending;   // offsets that have a height but haven't been followed
+  int pendingCount;
+} Flow;
+
+static bool reach(Flow* flow, int offset, int height) {
+  // running off the code or into the middle of an instruction is an error,
+  // and every way into an instruction must leave the stack equally high
+  if (offset < 0 || offset >= flow->count || flow->heights[offset] == -2) {
+    return false;
+  }
+  if (flow->heights[offset] == -1) {
+    flow->heights[offset] = height;
+    flow->pending[flow->pendingCount++] = offset;
+    return true;
+  }
+  return flow->heights[offset] == height;
+}
+
+int maxStackDepth(Chunk* chunk, int entry) {
+  // follows every path from the entry height, the callee and its arguments,
+  // to find the most slots a call of the chunk takes; -1 if a path runs off
+  // the code or into an operand, takes values or touches slots that aren't
+  // there, or meets another path at a different height
+  Flow flow;
+  flow.count = chunk->count;
+  flow.heights = malloc(sizeof(int) * (chunk->count + 1));
+  flow.pending = malloc(sizeof(int) * (chunk->count + 1));
+  flow.pendingCount = 0;
+  for (int i = 0; i < chunk->count; i++) flow.heights[i] = -2;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    flow.heights[offset] = -1;
+  }
+
+  int depth = entry;
+  bool valid = reach(&flow, 0, entry);
+  while (valid && flow.pendingCount > 0) {
+    int offset = flow.pending[--flow.pendingCount];
+    int height = flow.heights[offset];
+    StackEffect effect;
+    valid = stackEffect(chunk, offset, &effect) &&
+            effect.local < height && effect.pops <= height;
+    if (!valid) break;
+
+    if (height + effect.peak > depth) depth = height + effect.peak;
+    height += effect.pushes - effect.pops;
+    if (effect.falls) {
+      valid = reach(&flow, offset + instructionLength(chunk, offset), height);
+    }
+    if (effect.jumps) valid = valid && reach(&flow, effect.target, height);
+  }
+
+  free(flow.heights);
+  free(flow.pending);
+  return valid ? depth : -1;
+}
@@ -41,20 +41,103 @@ typedef enum {
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  // the instructions above with a 24-bit index, emitted by the compiler
+  // only once the index no longer fits the short operand
+  OP_CONSTANT_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_GET_SUPER_LONG,
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE_LONG,
+  OP_CLOSURE_LONG,
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
+  // superinstructions, only produced by the peephole pass in compiler.c
+  OP_ADD_CONST,              // OP_CONSTANT k; OP_ADD
+  OP_ADD_LOCAL_CONST,        // OP_GET_LOCAL a; OP_CONSTANT k; OP_ADD; OP_SET_LOCAL a; OP_POP
+  OP_LESS_JUMP_IF_FALSE,     // OP_LESS; OP_JUMP_IF_FALSE; OP_POP on both paths
+  OP_GREATER_JUMP_IF_FALSE,  // OP_GREATER; OP_JUMP_IF_FALSE; OP_POP on both paths
+  OP_GET_LOCAL_GET_PROPERTY  // OP_GET_LOCAL a; OP_GET_PROPERTY name cache
 } OpCode;  
 
+// each variable an OP_CLOSURE captures follows it as one of these, then
+// its index: one byte, or three for CAPTURE_LOCAL_LONG
+typedef enum {
+  CAPTURE_UPVALUE,     // an upvalue of the function making the closure
+  CAPTURE_LOCAL,       // one of its slots
+  CAPTURE_LOCAL_LONG   // one of its slots past 255
+} CaptureKind;
+
+#define INLINE_CACHE_WAYS 4
+
+// one remembered answer for a property access at a call site, keyed on the
+// receiver's shape (which also pins down its class)
+// slot >= 0 means the property is the field in that slot
+// slot == -1 means it is the class method stored in method
+// transition is set when OP_SET_PROPERTY adds the field: the shape afterwards
+typedef struct {
+  struct sObjShape* shape;
+  struct sObjShape* transition;
+  int slot;
+  Value method;
+} CacheEntry;
+
+// OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE each own one of these
+// it is monomorphic with one entry and polymorphic up to INLINE_CACHE_WAYS
+// after that the site is megamorphic and always takes the table lookup
+typedef struct {
+  int count;
+  CacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
+// code from offset up to the next LineStart was compiled from line
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct {
   int count;    
   int capacity; 
   uint8_t* code;
-  int* lines;  
+  // one entry per run of bytes from the same line, ordered by offset
+  int lineCount;
+  int lineCapacity;
+  LineStart* lines;  
   ValueArray constants;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;
 } Chunk;   
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);     
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value); 
+void freeChunk(VM* vm, Chunk* chunk);     
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+void addLine(VM* vm, Chunk* chunk, int offset, int line);
+int getLine(Chunk* chunk, int offset);
+void truncateChunk(Chunk* chunk, int count);
+int addConstant(VM* vm, Chunk* chunk, Value value); 
+int addInlineCache(VM* vm, Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
+
+// what running one instruction does to the stack
+typedef struct {
+  int pops;     // values it takes off the top
+  int pushes;   // values it leaves in their place
+  int peak;     // how far above its starting height the stack gets meanwhile
+  int local;    // the highest frame slot it touches, -1 for none
+  bool jumps;   // whether it may jump, and then to target
+  int target;
+  bool falls;   // whether it may go on to the next instruction
+} StackEffect;
+
+bool stackEffect(Chunk* chunk, int offset, StackEffect* effect);
+int maxStackDepth(Chunk* chunk, int entry);
 
 #endif  
\ No newline at end of file
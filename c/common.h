@@ -11,7 +11,30 @@
 
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_GC_STATS
+
+// full collections mark and sweep in slices of GC_STEP_BUDGET objects,
+// one slice per allocation, instead of stopping the program until done
+// #define GC_INCREMENTAL
+
+#ifndef GC_STEP_BUDGET
+#define GC_STEP_BUDGET 100
+#endif
+
+// intern strings with the word at a time hash in hash.c instead of FNV-1a,
+// `make hashbench` compares the two
+// #define FAST_HASH
+
+// run() uses labels-as-values for threaded dispatch when the compiler has them
+// define NO_COMPUTED_GOTO to force the portable switch loop instead
+// #define NO_COMPUTED_GOTO
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+// the widest index an instruction operand holds, see the _LONG opcodes
+#define UINT24_MAX 0xffffff
 
 #endif   
\ No newline at end of file
@@ -11,11 +11,17 @@
 #include "debug.h"     
 #endif
 
-typedef struct {       
-  Token current;       
+// the state of one compile, every function below works on it
+// so several can run at once, each on its own vm
+typedef struct sParser {
+  VM* vm;
+  Scanner scanner;
+  Token current;
   Token previous;
   bool hadError;
-  bool panicMode;      
+  bool panicMode;
+  struct Compiler* compiler;          // innermost function being compiled
+  struct ClassCompiler* currentClass; // innermost class being compiled
 } Parser;
 
 typedef enum {                  
@@ -32,7 +38,7 @@ typedef enum {
   PREC_PRIMARY                  
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {        
   ParseFn prefix;       
@@ -47,7 +53,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-  uint8_t index;
+  int index;
   bool isLocal; 
 } Upvalue;
 
@@ -58,7 +64,17 @@ typedef enum {
   TYPE_SCRIPT       // top level code
 } FunctionType; 
 
-// assigned to current
+#define FOLD_WINDOW 8
+
+// a constant pushed by the last instructions of the chunk
+// constant is its index in the constant table, or -1 for OP_NIL/OP_TRUE/OP_FALSE
+typedef struct {
+  int offset;
+  int constant;
+  Value value;
+} PendingConstant;
+
+// assigned to parser->compiler
 // each compiler is repsonsible for exactly one function
 typedef struct Compiler {
   struct Compiler* enclosing; // pointer to parent function's compiler
@@ -68,13 +84,19 @@ typedef struct Compiler {
 
   // simulation of local variables during compile time
   // rely on it to give local variable index
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
+  int localCapacity;
   Upvalue upvalues[UINT8_COUNT];          
   int scopeDepth;           
+
+  // the pending constants sit back to back at the very end of the chunk
+  // any other instruction or a jump landing here empties the window
+  PendingConstant pending[FOLD_WINDOW];
+  int pendingCount;
 } Compiler;
 
-// assigned to currentClass
+// assigned to parser->currentClass
 // each classCompiler is repsonsible for exactly one class
 // to remember whether inside a class (so "this" makes sense)
 // and whether hasSuperClass (so "super" makes sense)
@@ -84,156 +106,281 @@ typedef struct ClassCompiler {
   bool hasSuperclass;                      
 } ClassCompiler;
 
-Parser parser;
-
-Compiler* current = NULL;
-
-ClassCompiler* currentClass = NULL;
-
-Chunk* compilingChunk;
-
-static Chunk* currentChunk() {                          
-  return &current->function->chunk;                     
+static Chunk* currentChunk(Parser* parser) {                          
+  return &parser->compiler->function->chunk;                     
 }
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+  if (parser->panicMode) return;
+  parser->panicMode = true;
 
-  fprintf(stderr, "[line %d] Error", token->line);
+  fprintf(parser->vm->errors, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {                              
-    fprintf(stderr, " at end");                                
+    fprintf(parser->vm->errors, " at end");                                
   } else if (token->type == TOKEN_ERROR) {                     
     // Nothing.                                                
   } else {                                                     
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(parser->vm->errors, " at '%.*s'", token->length, token->start);
   }                                                            
 
-  fprintf(stderr, ": %s\n", message);                          
-  parser.hadError = true;                                      
+  fprintf(parser->vm->errors, ": %s\n", message);                          
+  parser->hadError = true;                                      
 }
 
-static void error(const char* message) {
-  errorAt(&parser.previous, message);   
+static void error(Parser* parser, const char* message) {
+  errorAt(parser, &parser->previous, message);   
 }
 
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);             
+static void errorAtCurrent(Parser* parser, const char* message) {
+  errorAt(parser, &parser->current, message);             
 } 
 
-static void advance() {                           
-  parser.previous = parser.current;
+static void advance(Parser* parser) {                           
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scanToken();                 
-    if (parser.current.type != TOKEN_ERROR) break;
+    parser->current = scanToken(&parser->scanner);                 
+    if (parser->current.type != TOKEN_ERROR) break;
 
     // normally start point to source code
     // but when error occured, start point to error message 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }                                               
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {                      
-    advance();                                            
+static void consume(Parser* parser, TokenType type, const char* message) {
+  if (parser->current.type == type) {                      
+    advance(parser);                                            
     return;                                               
   }
 
-  errorAtCurrent(message);                                
+  errorAtCurrent(parser, message);                                
 }
 
-static bool check(TokenType type) {  
-  return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {  
+  return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) return false;  
-  advance();                       
+static bool match(Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;  
+  advance(parser);                       
   return true;                     
 }
 
-static void emitByte(uint8_t byte) {                     
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {                     
+  parser->compiler->pendingCount = 0;
+  writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);                                   
-  emitByte(byte2);                                   
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);                                   
+  emitByte(parser, byte2);                                   
 }
 
-static void emitLoop(int loopStart) {                    
-  emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {                    
+  emitByte(parser, OP_LOOP);
 
-  int offset = currentChunk()->count - loopStart + 2;    
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk(parser)->count - loopStart + 2;    
+  if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-  emitByte((offset >> 8) & 0xff);                        
-  emitByte(offset & 0xff);                               
+  emitByte(parser, (offset >> 8) & 0xff);                        
+  emitByte(parser, offset & 0xff);                               
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);                  
-  emitByte(0xff);                         
-  emitByte(0xff);                         
-  return currentChunk()->count - 2;       
+static int emitJump(Parser* parser, uint8_t instruction) {
+  emitByte(parser, instruction);                  
+  emitByte(parser, 0xff);                         
+  emitByte(parser, 0xff);                         
+  return currentChunk(parser)->count - 2;       
 }
 
-static void emitReturn() { // called for implicit return (without return statement)
-  if (current->type == TYPE_INITIALIZER) {
-    emitBytes(OP_GET_LOCAL, 0);           
+static void emitReturn(Parser* parser) { // called for implicit return (without return statement)
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);           
   } else {                                
-    emitByte(OP_NIL);                     
+    emitByte(parser, OP_NIL);                     
   }
 
-  emitByte(OP_RETURN);    
+  emitByte(parser, OP_RETURN);    
 }
 
-static uint8_t makeConstant(Value value) {          
-  int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {                       
-    error("Too many constants in one chunk.");      
+static uint8_t longOpcode(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:      return OP_CONSTANT_LONG;
+    case OP_GET_LOCAL:     return OP_GET_LOCAL_LONG;
+    case OP_SET_LOCAL:     return OP_SET_LOCAL_LONG;
+    case OP_GET_GLOBAL:    return OP_GET_GLOBAL_LONG;
+    case OP_DEFINE_GLOBAL: return OP_DEFINE_GLOBAL_LONG;
+    case OP_SET_GLOBAL:    return OP_SET_GLOBAL_LONG;
+    case OP_GET_PROPERTY:  return OP_GET_PROPERTY_LONG;
+    case OP_SET_PROPERTY:  return OP_SET_PROPERTY_LONG;
+    case OP_GET_SUPER:     return OP_GET_SUPER_LONG;
+    case OP_INVOKE:        return OP_INVOKE_LONG;
+    case OP_SUPER_INVOKE:  return OP_SUPER_INVOKE_LONG;
+    case OP_CLOSURE:       return OP_CLOSURE_LONG;
+    case OP_CLASS:         return OP_CLASS_LONG;
+    case OP_METHOD:        return OP_METHOD_LONG;
+    default:
+      return op; // Unreachable.
+  }
+}
+
+static void emitIndexed(Parser* parser, uint8_t op, int index) {
+  // the index takes one byte, or two for a global slot
+  // a bigger one switches to the _LONG form with three bytes,
+  // so the vm only pays for wide operands where they are needed
+  bool isGlobal = op == OP_GET_GLOBAL || op == OP_DEFINE_GLOBAL ||
+                  op == OP_SET_GLOBAL;
+  if (index > (isGlobal ? UINT16_MAX : UINT8_MAX)) {
+    emitByte(parser, longOpcode(op));
+    emitByte(parser, (index >> 16) & 0xff);
+    emitByte(parser, (index >> 8) & 0xff);
+    emitByte(parser, index & 0xff);
+    return;
+  }
+
+  emitByte(parser, op);
+  if (isGlobal) emitByte(parser, (index >> 8) & 0xff);
+  emitByte(parser, index & 0xff);
+}
+
+static int makeConstant(Parser* parser, Value value) {          
+  int constant = addConstant(parser->vm, currentChunk(parser), value);
+  // the function may have been promoted by a gc while it was compiled
+  WRITE_BARRIER(parser->vm, (Obj*)parser->compiler->function, value);
+  if (constant > UINT24_MAX) {                       
+    error(parser, "Too many constants in one chunk.");      
     return 0;                                       
   }
 
-  return (uint8_t)constant;                         
+  return constant;                         
+}
+
+static void addPending(Parser* parser, int offset, int constant,
+                       Value value) {
+  Compiler* compiler = parser->compiler;
+  if (compiler->pendingCount == FOLD_WINDOW) {
+    // only the newest constants can still be folded
+    memmove(compiler->pending, compiler->pending + 1,
+            sizeof(PendingConstant) * (FOLD_WINDOW - 1));
+    compiler->pendingCount--;
+  }
+
+  PendingConstant* pending = &compiler->pending[compiler->pendingCount++];
+  pending->offset = offset;
+  pending->constant = constant;
+  pending->value = value;
+}
+
+static void emitConstant(Parser* parser, Value value) {       
+  int constant = makeConstant(parser, value);
+  int pendingCount = parser->compiler->pendingCount;
+  int offset = currentChunk(parser)->count;
+  emitIndexed(parser, OP_CONSTANT, constant);
+  parser->compiler->pendingCount = pendingCount;
+  addPending(parser, offset, constant, value);
+}
+
+static void emitLiteral(Parser* parser, Value value) {
+  // folded results go back through here so they can be folded again
+  if (!IS_NIL(value) && !IS_BOOL(value)) {
+    emitConstant(parser, value);
+    return;
+  }
+
+  int pendingCount = parser->compiler->pendingCount;
+  if (IS_NIL(value)) {
+    emitByte(parser, OP_NIL);
+  } else {
+    emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  }
+  parser->compiler->pendingCount = pendingCount;
+  addPending(parser, currentChunk(parser)->count - 1, -1, value);
+}
+
+static PendingConstant* peekPending(Parser* parser, int distance) {
+  Compiler* compiler = parser->compiler;
+  if (compiler->pendingCount <= distance) return NULL;
+  return &compiler->pending[compiler->pendingCount - 1 - distance];
+}
+
+static void dropPending(Parser* parser, int count) {
+  // remove the last count pending constants from the code, and from the
+  // constant table as well when nothing was added after them
+  Compiler* compiler = parser->compiler;
+  Chunk* chunk = currentChunk(parser);
+  for (int i = 0; i < count; i++) {
+    PendingConstant* pending = &compiler->pending[--compiler->pendingCount];
+    truncateChunk(chunk, pending->offset);
+    if (pending->constant != -1 &&
+        pending->constant == chunk->constants.count - 1) {
+      chunk->constants.count--;
+    }
+  }
 }
 
-static void emitConstant(Value value) {       
-  emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitInlineCache(Parser* parser) {
+  // property instructions carry a 16-bit index of their inline cache in the chunk
+  int cache = addInlineCache(parser->vm, currentChunk(parser));
+  if (cache > UINT16_MAX) {
+    error(parser, "Too many property accesses in one chunk.");
+  }
+
+  emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff);
 }
 
-static void patchJump(int offset) {                           
+static void patchJump(Parser* parser, int offset) {                           
+  // code after a jump target must not be folded into code before it
+  parser->compiler->pendingCount = 0;
+
   // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+  int jump = currentChunk(parser)->count - offset - 2;
 
   if (jump > UINT16_MAX) {                                    
-    error("Too much code to jump over.");                     
+    error(parser, "Too much code to jump over.");                     
   }                                                           
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;          
-  currentChunk()->code[offset + 1] = jump & 0xff;             
+  currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;          
+  currentChunk(parser)->code[offset + 1] = jump & 0xff;             
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-  compiler->enclosing = current;
+static Local* pushLocal(Parser* parser) {
+  Compiler* compiler = parser->compiler;
+  if (compiler->localCount == compiler->localCapacity) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->locals = GROW_ARRAY(parser->vm, compiler->locals, Local,
+                                  oldCapacity, compiler->localCapacity);
+  }
+
+  return &compiler->locals[compiler->localCount++];
+}
+
+static void initCompiler(Parser* parser, Compiler* compiler,
+                         FunctionType type) {
+  compiler->enclosing = parser->compiler;
   
   compiler->function = NULL; // set NULL then set to newFunction later, due to gc                          
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;                   
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();                   
-  current = compiler;
+  compiler->pendingCount = 0;
+  compiler->function = newFunction(parser->vm);                   
+  parser->compiler = compiler;
 
   if (type != TYPE_SCRIPT) {                                     
-    current->function->name = copyString(parser.previous.start,  
-                                         parser.previous.length);
+    compiler->function->name = copyString(parser->vm, parser->previous.start,
+                                          parser->previous.length);
+    WRITE_BARRIER(parser->vm, (Obj*)compiler->function,
+                  OBJ_VAL(compiler->function->name));
   }
 
   // the first local correspond to the first slot local substack during run time
   // which is first used to store the callee of OP_CALL, then reused to store this instance
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal(parser);
   local->depth = 0;
   local->isCaptured = false;
   if (type != TYPE_FUNCTION) {
@@ -248,14 +395,29 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }                        
 } 
 
-static void expression();
-static void statement();                  
-static void declaration();                          
-static ParseRule* getRule(TokenType type);         
-static void parsePrecedence(Precedence precedence);
+static void expression(Parser* parser);
+static void statement(Parser* parser);                  
+static void declaration(Parser* parser);                          
+static const ParseRule* getRule(TokenType type);         
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {                      
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifierConstant(Parser* parser, Token* name) {                      
+  ObjString* string = copyString(parser->vm, name->start, name->length);
+  return makeConstant(parser, OBJ_VAL(string));
+}
+
+static int globalVariable(Parser* parser, Token* name) {
+  // globals are addressed by a vm wide slot, not by name
+  ObjString* string = copyString(parser->vm, name->start, name->length);
+  push(parser->vm, OBJ_VAL(string));
+  int slot = globalSlot(parser->vm, string);
+  pop(parser->vm);
+
+  if (slot > UINT24_MAX) {
+    error(parser, "Too many global variables.");
+    return 0;
+  }
+  return slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {  
@@ -263,13 +425,13 @@ static bool identifiersEqual(Token* a, Token* b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
   // handles var a=1; {print a; var a=2;} case
   for (int i = compiler->localCount - 1; i >= 0; i--) {   
     Local* local = &compiler->locals[i];                  
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) { // handles {var a=a;} case                                     
-        error("Cannot read local variable in its own initializer.");
+        error(parser, "Cannot read local variable in its own initializer.");
       }          
       return i;                                           
     }                                                     
@@ -278,7 +440,8 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;                                              
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, int index,
+                      bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
   for (int i = 0; i < upvalueCount; i++) {                       
@@ -289,7 +452,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
   }
 
   if (upvalueCount == UINT8_COUNT) {                             
-    error("Too many closure variables in function.");            
+    error(parser, "Too many closure variables in function.");            
     return 0;                                                    
   }
 
@@ -298,245 +461,563 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
   return compiler->function->upvalueCount++; // the only place upvalueCount get modified
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
   if (compiler->enclosing == NULL) return -1;
 
   // local starts from index 1, because index 0 is the function itself
-  int local = resolveLocal(compiler->enclosing, name);      
+  int local = resolveLocal(parser, compiler->enclosing, name);      
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);      
+    return addUpvalue(parser, compiler, local, true);      
   }
 
   // upValue starts from index 0
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {                                    
-    return addUpvalue(compiler, (uint8_t)upvalue, false); 
+    return addUpvalue(parser, compiler, upvalue, false); 
   }
 
   return -1;                                                
 }
 
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {              
-    error("Too many local variables in function.");      
+static void addLocal(Parser* parser, Token name) {
+  if (parser->compiler->localCount > UINT24_MAX) {              
+    error(parser, "Too many local variables in function.");      
     return;                                              
   } 
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal(parser);
   local->name = name;                                    
   local->depth = -1;
   local->isCaptured = false;                  
 }
 
-static void declareVariable() {               
+static void declareVariable(Parser* parser) {               
   // Global variables are implicitly declared.
-  if (current->scopeDepth == 0) return;
+  if (parser->compiler->scopeDepth == 0) return;
 
-  Token* name = &parser.previous;
+  Token* name = &parser->previous;
 
   // detect varible re-declaration
-  for (int i = current->localCount - 1; i >= 0; i--) {                 
-    Local* local = &current->locals[i];                                
-    if (local->depth != -1 && local->depth < current->scopeDepth) {    
+  for (int i = parser->compiler->localCount - 1; i >= 0; i--) {                 
+    Local* local = &parser->compiler->locals[i];                                
+    if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {    
       break; 
     }
 
     if (identifiersEqual(name, &local->name)) {                        
-      error("Variable with this name already declared in this scope.");
+      error(parser, "Variable with this name already declared in this scope.");
     }                                                                  
   }
                
-  addLocal(*name);                            
-}
-
-static void and_(bool canAssign) {         
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
-
-  emitByte(OP_POP);                        
-  parsePrecedence(PREC_AND);               
-
-  patchJump(endJump);                      
+  addLocal(parser, *name);                            
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static int parseVariable(Parser* parser, const char* errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
   // the following two parts' order can be exchanged
 
   // purely for local variable
-  declareVariable();                          
-  if (current->scopeDepth > 0) return 0;
+  declareVariable(parser);                          
+  if (parser->compiler->scopeDepth > 0) return 0;
 
   // purely for global variable
-  return identifierConstant(&parser.previous);          
+  return globalVariable(parser, &parser->previous);          
 }
 
-static void markInitialized() {
-  if (current->scopeDepth == 0) return; // useful only for funDeclaration
-  current->locals[current->localCount - 1].depth =
-      current->scopeDepth;                        
+static void markInitialized(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return; // useful only for funDeclaration
+  parser->compiler->locals[parser->compiler->localCount - 1].depth =
+      parser->compiler->scopeDepth;                        
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(Parser* parser, int global) {
   // variable's initialization value is already on the stack top, no matter it's local or global
 
   // for local variable, nothing else need to be done since it lives on the stack
   // so no OP_DEFINE_LOCAL
-  if (current->scopeDepth > 0) {
-    markInitialized();           
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser);           
     return;                                 
   }
 
-  // for global variable, need to move the value to vm.globals
+  // for global variable, need to move the value to its slot in vm.globalValues
   // then clear the stack top, because varDeclaration is a statement returning no value
-  emitBytes(OP_DEFINE_GLOBAL, global);      
+  emitIndexed(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList() {                             
+static uint8_t argumentList(Parser* parser) {                             
   uint8_t argCount = 0;                                     
-  if (!check(TOKEN_RIGHT_PAREN)) {                          
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {                          
     do {                                                    
-      expression();
+      expression(parser);
 
       if (argCount == 255) {                          
-        error("Cannot have more than 255 arguments.");
+        error(parser, "Cannot have more than 255 arguments.");
       }                                        
       argCount++;                                           
-    } while (match(TOKEN_COMMA));                           
+    } while (match(parser, TOKEN_COMMA));                           
   }
 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return argCount;                                          
 }
 
-static void grouping(bool canAssign) {                                     
-  expression();                                              
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {                                     
+  expression(parser);                                              
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static ObjFunction*  endCompiler() {
-  emitReturn();
-  ObjFunction* function = current->function;
+// the peephole pass below rewrites a finished chunk in place, fusing hot
+// sequences into superinstructions. a sequence is only fused when nothing
+// jumps into its middle, and every jump is re-pointed afterwards
+typedef struct {
+  int offset; // where the jump instruction ended up
+  int target; // the old offset it jumps to
+} JumpPatch;
+
+static bool isJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_LOOP;
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+static bool matchSequence(Chunk* chunk, bool* isTarget, int offset,
+                          const OpCode* sequence, int length) {
+  for (int i = 0; i < length; i++) {
+    if (offset >= chunk->count || chunk->code[offset] != sequence[i]) {
+      return false;
+    }
+    if (i > 0 && isTarget[offset]) return false;
+    offset += instructionLength(chunk, offset);
+  }
+  return true;
+}
+
+static void optimizeChunk(Parser* parser, Chunk* chunk) {
+  static const OpCode addLocalConst[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP
+  };
+  static const OpCode lessJump[] = {OP_LESS, OP_JUMP_IF_FALSE, OP_POP};
+  static const OpCode greaterJump[] = {OP_GREATER, OP_JUMP_IF_FALSE, OP_POP};
+  static const OpCode getLocalProperty[] = {OP_GET_LOCAL, OP_GET_PROPERTY};
+  static const OpCode addConst[] = {OP_CONSTANT, OP_ADD};
+
+  int count = chunk->count;
+  uint8_t* code = chunk->code;
+  bool* isTarget = ALLOCATE(parser->vm, bool, count + 1);
+  int* newOffset = ALLOCATE(parser->vm, int, count + 1);
+  // every jump takes at least 3 bytes
+  JumpPatch* patches = ALLOCATE(parser->vm, JumpPatch, count / 3 + 1);
+  int patchCount = 0;
+
+  // the line table is rebuilt as the code is written back
+  int* lines = ALLOCATE(parser->vm, int, count);
+  for (int i = 0; i < count; i++) lines[i] = getLine(chunk, i);
+  chunk->lineCount = 0;
+
+  for (int i = 0; i <= count; i++) isTarget[i] = false;
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    if (!isJump(code[offset])) continue;
+
+    int target = jumpTarget(chunk, offset);
+    isTarget[target] = true;
+    // a fused jump lands just past the OP_POP at its target
+    if (code[offset] == OP_JUMP_IF_FALSE && target < count &&
+        code[target] == OP_POP) {
+      isTarget[target + 1] = true;
+    }
+  }
+
+  // the output never runs ahead of the input, so operands are read
+  // before anything is written over them
+  int from = 0;
+  int to = 0;
+  while (from < count) {
+    int line = lines[from];
+    uint8_t fused[5];
+    int fusedLength = 0;
+    int consumed = 0;
+    newOffset[from] = to;
+
+    if (matchSequence(chunk, isTarget, from, addLocalConst, 5) &&
+        code[from + 1] == code[from + 6]) {
+      fused[0] = OP_ADD_LOCAL_CONST;
+      fused[1] = code[from + 1];
+      fused[2] = code[from + 3];
+      fusedLength = 3;
+      consumed = 8;
+    } else if ((matchSequence(chunk, isTarget, from, lessJump, 3) ||
+                matchSequence(chunk, isTarget, from, greaterJump, 3)) &&
+               code[jumpTarget(chunk, from + 1)] == OP_POP) {
+      fused[0] = code[from] == OP_LESS ? OP_LESS_JUMP_IF_FALSE
+                                       : OP_GREATER_JUMP_IF_FALSE;
+      fused[1] = 0xff;
+      fused[2] = 0xff;
+      fusedLength = 3;
+      consumed = 5;
+      patches[patchCount].offset = to;
+      patches[patchCount].target = jumpTarget(chunk, from + 1) + 1;
+      patchCount++;
+    } else if (matchSequence(chunk, isTarget, from, getLocalProperty, 2)) {
+      fused[0] = OP_GET_LOCAL_GET_PROPERTY;
+      fused[1] = code[from + 1];
+      fused[2] = code[from + 3];
+      fused[3] = code[from + 4];
+      fused[4] = code[from + 5];
+      fusedLength = 5;
+      consumed = 6;
+    } else if (matchSequence(chunk, isTarget, from, addConst, 2)) {
+      fused[0] = OP_ADD_CONST;
+      fused[1] = code[from + 1];
+      fusedLength = 2;
+      consumed = 3;
+    }
+
+    if (fusedLength > 0) {
+      for (int i = 0; i < fusedLength; i++) {
+        code[to] = fused[i];
+        addLine(parser->vm, chunk, to, line);
+        to++;
+      }
+    } else {
+      if (isJump(code[from])) {
+        patches[patchCount].offset = to;
+        patches[patchCount].target = jumpTarget(chunk, from);
+        patchCount++;
+      }
+
+      consumed = instructionLength(chunk, from);
+      for (int i = 0; i < consumed; i++) {
+        code[to] = code[from + i];
+        addLine(parser->vm, chunk, to, lines[from + i]);
+        to++;
+      }
+    }
+
+    from += consumed;
+  }
+  newOffset[count] = to;
+
+  for (int i = 0; i < patchCount; i++) {
+    int offset = patches[i].offset;
+    int target = newOffset[patches[i].target];
+    // fusing only shrinks code, so a jump that fit before still fits
+    int jump = code[offset] == OP_LOOP ? offset + 3 - target
+                                       : target - (offset + 3);
+    code[offset + 1] = (jump >> 8) & 0xff;
+    code[offset + 2] = jump & 0xff;
+  }
+  chunk->count = to;
+
+  FREE_ARRAY(parser->vm, bool, isTarget, count + 1);
+  FREE_ARRAY(parser->vm, int, newOffset, count + 1);
+  FREE_ARRAY(parser->vm, JumpPatch, patches, count / 3 + 1);
+  FREE_ARRAY(parser->vm, int, lines, count);
+}
+
+static ObjFunction*  endCompiler(Parser* parser) {
+  emitReturn(parser);
+  ObjFunction* function = parser->compiler->function;
+  if (!parser->hadError) {
+    optimizeChunk(parser, currentChunk(parser));
+    // the vm sizes each call's stack window from this, so it is taken from
+    // the final code, after the peephole pass
+    function->maxSlots = maxStackDepth(currentChunk(parser),
+                                       function->arity + 1);
+  }
 #ifdef DEBUG_PRINT_CODE                      
-  if (!parser.hadError) {                    
-    disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+  if (!parser->hadError) {                    
+    disassembleChunk(parser->vm, currentChunk(parser),
+                     function->name != NULL ? function->name->chars : "<script>");
   }                                          
 #endif 
-  current = current->enclosing;
+  FREE_ARRAY(parser->vm, Local, parser->compiler->locals,
+             parser->compiler->localCapacity);
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
-static void beginScope() {
-  current->scopeDepth++;  
+static void beginScope(Parser* parser) {
+  parser->compiler->scopeDepth++;  
 }
 
-static void endScope() {
-  current->scopeDepth--;
+static void endScope(Parser* parser) {
+  parser->compiler->scopeDepth--;
 
   // pop all local variables at current depth
   // there can be many levels of block scopes, so here to check scopeDepth
-  while (current->localCount > 0 &&                      
-         current->locals[current->localCount - 1].depth >
-            current->scopeDepth) {                       
-    if (current->locals[current->localCount - 1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);                             
+  while (parser->compiler->localCount > 0 &&                      
+         parser->compiler->locals[parser->compiler->localCount - 1].depth >
+            parser->compiler->scopeDepth) {                       
+    if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured) {
+      emitByte(parser, OP_CLOSE_UPVALUE);                             
     } else {                                                  
-      emitByte(OP_POP);                                       
+      emitByte(parser, OP_POP);                                       
     }                                    
-    current->localCount--;                               
+    parser->compiler->localCount--;                               
   }
 }
 
-static void binary(bool canAssign) {                                    
+static bool isFalseyConstant(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool foldBinary(Parser* parser, TokenType operatorType) {
+  PendingConstant* right = peekPending(parser, 0);
+  PendingConstant* left = peekPending(parser, 1);
+  if (left == NULL || right == NULL) return false;
+
+  Value a = left->value;
+  Value b = right->value;
+  Value result;
+  switch (operatorType) {
+    case TOKEN_BANG_EQUAL:  result = BOOL_VAL(!valuesEqual(a, b)); break;
+    case TOKEN_EQUAL_EQUAL: result = BOOL_VAL(valuesEqual(a, b)); break;
+    case TOKEN_PLUS:
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      } else if (IS_STRING(a) && IS_STRING(b)) {
+        // both operands stay in the constant table until dropped below
+        ObjString* x = AS_STRING(a);
+        ObjString* y = AS_STRING(b);
+        ObjString* string = allocateString(parser->vm, x->length + y->length);
+        memcpy(string->chars, x->chars, x->length);
+        memcpy(string->chars + x->length, y->chars, y->length);
+        result = OBJ_VAL(takeString(parser->vm, string));
+      } else {
+        return false; // leave the type error to run time
+      }
+      break;
+    default: {
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+      double x = AS_NUMBER(a);
+      double y = AS_NUMBER(b);
+      switch (operatorType) {
+        // >= and <= negate the opposite comparison, as the emitted code does
+        case TOKEN_GREATER:       result = BOOL_VAL(x > y); break;
+        case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+        case TOKEN_LESS:          result = BOOL_VAL(x < y); break;
+        case TOKEN_LESS_EQUAL:    result = BOOL_VAL(!(x > y)); break;
+        case TOKEN_MINUS:         result = NUMBER_VAL(x - y); break;
+        case TOKEN_STAR:          result = NUMBER_VAL(x * y); break;
+        case TOKEN_SLASH:         result = NUMBER_VAL(x / y); break;
+        default:
+          return false;
+      }
+    }
+  }
+
+  dropPending(parser, 2);
+  emitLiteral(parser, result);
+  return true;
+}
+
+static bool foldUnary(Parser* parser, TokenType operatorType) {
+  PendingConstant* operand = peekPending(parser, 0);
+  if (operand == NULL) return false;
+
+  Value value = operand->value;
+  Value result;
+  switch (operatorType) {
+    case TOKEN_BANG:
+      result = BOOL_VAL(isFalseyConstant(value));
+      break;
+    case TOKEN_MINUS:
+      if (!IS_NUMBER(value)) return false;
+      result = NUMBER_VAL(-AS_NUMBER(value));
+      break;
+    default:
+      return false;
+  }
+
+  dropPending(parser, 1);
+  emitLiteral(parser, result);
+  return true;
+}
+
+static bool foldCondition(Parser* parser, bool* truthy) {
+  // a condition that folded down to one constant is taken off the chunk
+  PendingConstant* condition = peekPending(parser, 0);
+  if (condition == NULL) return false;
+
+  *truthy = !isFalseyConstant(condition->value);
+  dropPending(parser, 1);
+  return true;
+}
+
+// how far the chunk had got where a statement that may turn out dead starts
+typedef struct {
+  int code;
+  int constants;
+  int caches;
+} CodeMark;
+
+static CodeMark markCode(Parser* parser) {
+  Chunk* chunk = currentChunk(parser);
+  CodeMark mark = {chunk->count, chunk->constants.count, chunk->cacheCount};
+  return mark;
+}
+
+static void discardCode(Parser* parser, CodeMark start) {
+  // drop a statically dead statement compiled from start, with the
+  // constants and inline caches only it used
+  Chunk* chunk = currentChunk(parser);
+  truncateChunk(chunk, start.code);
+  chunk->constants.count = start.constants;
+  chunk->cacheCount = start.caches;
+  parser->compiler->pendingCount = 0;
+}
+
+static void deadOperand(Parser* parser, Precedence precedence) {
+  // an operand that can never run is compiled for its errors and dropped,
+  // and the constants pending before it can be folded on
+  int pendingCount = parser->compiler->pendingCount;
+  CodeMark start = markCode(parser);
+  parsePrecedence(parser, precedence);
+  discardCode(parser, start);
+  parser->compiler->pendingCount = pendingCount;
+}
+
+static void binary(Parser* parser, bool canAssign) {                                    
   // Remember the operator.                                
-  TokenType operatorType = parser.previous.type;
+  TokenType operatorType = parser->previous.type;
 
   // Compile the right operand.                            
-  ParseRule* rule = getRule(operatorType);                 
-  parsePrecedence((Precedence)(rule->precedence + 1));     
+  const ParseRule* rule = getRule(operatorType);                 
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));     
+
+  if (foldBinary(parser, operatorType)) return;
 
   // Emit the operator instruction.                        
   switch (operatorType) { 
-    case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;  
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;           
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;         
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;   
-    case TOKEN_LESS:          emitByte(OP_LESS); break;            
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;                                 
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;     
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;  
+    case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQUAL, OP_NOT); break;  
+    case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;           
+    case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;         
+    case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;   
+    case TOKEN_LESS:          emitByte(parser, OP_LESS); break;            
+    case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;                                 
+    case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;     
+    case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+    case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;  
     default:                                               
       return; // Unreachable.                              
   }                                                        
 }
 
-static void call(bool canAssign) {
+static void call(Parser* parser, bool canAssign) {
   // in compile time, call doesn't care whether it's lox or native function 
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);     
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);     
 }
 
-static void dot(bool canAssign) {                              
-  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
-
-  if (canAssign && match(TOKEN_EQUAL)) {                       
-    expression();                                              
-    emitBytes(OP_SET_PROPERTY, name);                          
-  } else if (match(TOKEN_LEFT_PAREN)) { 
-    uint8_t argCount = argumentList();  
-    emitBytes(OP_INVOKE, name);         
-    emitByte(argCount);                 
+static void dot(Parser* parser, bool canAssign) {                              
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  int name = identifierConstant(parser, &parser->previous);
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {                       
+    expression(parser);                                              
+    emitIndexed(parser, OP_SET_PROPERTY, name);                          
+    emitInlineCache(parser);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) { 
+    uint8_t argCount = argumentList(parser);  
+    emitIndexed(parser, OP_INVOKE, name);         
+    emitByte(parser, argCount);                 
+    emitInlineCache(parser);
   } else {                                                     
-    emitBytes(OP_GET_PROPERTY, name);                          
+    emitIndexed(parser, OP_GET_PROPERTY, name);                          
+    emitInlineCache(parser);
   }                                                            
 }
 
-static void literal(bool canAssign) {                         
-  switch (parser.previous.type) {               
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;    
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;  
+static void literal(Parser* parser, bool canAssign) {                         
+  switch (parser->previous.type) {               
+    case TOKEN_FALSE: emitLiteral(parser, BOOL_VAL(false)); break;
+    case TOKEN_NIL: emitLiteral(parser, NIL_VAL); break;    
+    case TOKEN_TRUE: emitLiteral(parser, BOOL_VAL(true)); break;  
     default:                                    
       return; // Unreachable.                   
   }                                             
 } 
 
-static void number(bool canAssign) {                               
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));                           
+static void number(Parser* parser, bool canAssign) {                               
+  double value = strtod(parser->previous.start, NULL);
+  emitConstant(parser, NUMBER_VAL(value));                           
+}
+
+static void and_(Parser* parser, bool canAssign) {         
+  // a constant left operand decides at compile time: false and x is false
+  // without running x, true and x is x
+  PendingConstant* left = peekPending(parser, 0);
+  if (left != NULL) {
+    if (isFalseyConstant(left->value)) {
+      deadOperand(parser, PREC_AND);
+    } else {
+      dropPending(parser, 1);
+      parsePrecedence(parser, PREC_AND);
+    }
+    return;
+  }
+
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+
+  emitByte(parser, OP_POP);                        
+  parsePrecedence(parser, PREC_AND);               
+
+  patchJump(parser, endJump);                      
 }
 
-static void or_(bool canAssign) {           
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {           
+  // likewise true or x is true without running x, false or x is x
+  PendingConstant* left = peekPending(parser, 0);
+  if (left != NULL) {
+    if (!isFalseyConstant(left->value)) {
+      deadOperand(parser, PREC_OR);
+    } else {
+      dropPending(parser, 1);
+      parsePrecedence(parser, PREC_OR);
+    }
+    return;
+  }
 
-  patchJump(elseJump);                      
-  emitByte(OP_POP);                         
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
 
-  parsePrecedence(PREC_OR);                 
-  patchJump(endJump);                       
+  patchJump(parser, elseJump);                      
+  emitByte(parser, OP_POP);                         
+
+  parsePrecedence(parser, PREC_OR);                 
+  patchJump(parser, endJump);                       
 }
 
-static void string(bool canAssign) {                                        
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,    
-                                  parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {                                        
+  emitConstant(parser, OBJ_VAL(copyString(parser->vm,
+                                          parser->previous.start + 1,
+                                          parser->previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign) {   
+static void namedVariable(Parser* parser, Token name, bool canAssign) {   
   uint8_t getOp, setOp;                                
-  int arg = resolveLocal(current, &name);              
+  int arg = resolveLocal(parser, parser->compiler, &name);              
   if (arg != -1) {                                     
     getOp = OP_GET_LOCAL;                              
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+  } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
     getOp = OP_GET_UPVALUE;                                 
     setOp = OP_SET_UPVALUE;                              
   } else {                                             
-    arg = identifierConstant(&name);                   
+    // a global that is never defined still gets a slot,
+    // using it is a runtime error just like before
+    arg = globalVariable(parser, &name);                   
     getOp = OP_GET_GLOBAL;                             
     setOp = OP_SET_GLOBAL;                             
   }
@@ -544,16 +1025,17 @@ static void namedVariable(Token name, bool canAssign) {
   // maybe can avoid the canAssign mess by considering TOKEN_EQUAL as an infix operator
   // maybe not, because we stil have to check left operand, and that need special treatment
   // canAssign = false but next token is TOKEN_EQUAL, then won't consume TOKEN_EQUAL, will leak to parsePrecedence
-  if (canAssign && match(TOKEN_EQUAL)) { 
-    expression();                         
-    emitBytes(setOp, (uint8_t)arg);        
-  } else {                                
-    emitBytes(getOp, (uint8_t)arg);        
-  }       
+  uint8_t op = getOp;
+  if (canAssign && match(parser, TOKEN_EQUAL)) { 
+    expression(parser);                         
+    op = setOp;
+  }
+
+  emitIndexed(parser, op, arg);
 }
 
-static void variable(bool canAssign) {      
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {      
+  namedVariable(parser, parser->previous, canAssign);
 }
 
 static Token syntheticToken(const char* text) {
@@ -563,53 +1045,55 @@ static Token syntheticToken(const char* text) {
   return token;                                
 }
 
-static void super_(bool canAssign) {
-  if (currentClass == NULL) {                                  
-    error("Cannot use 'super' outside of a class.");           
-  } else if (!currentClass->hasSuperclass) {                   
-    error("Cannot use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool canAssign) {
+  if (parser->currentClass == NULL) {                                  
+    error(parser, "Cannot use 'super' outside of a class.");           
+  } else if (!parser->currentClass->hasSuperclass) {                   
+    error(parser, "Cannot use 'super' in a class with no superclass.");
   }
 
-  consume(TOKEN_DOT, "Expect '.' after 'super'.");            
-  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");            
+  consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  int name = identifierConstant(parser, &parser->previous);
 
-  namedVariable(syntheticToken("this"), false);       
-  if (match(TOKEN_LEFT_PAREN)) {                  
-    uint8_t argCount = argumentList();            
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);             
-    emitByte(argCount);                           
+  namedVariable(parser, syntheticToken("this"), false);       
+  if (match(parser, TOKEN_LEFT_PAREN)) {                  
+    uint8_t argCount = argumentList(parser);            
+    namedVariable(parser, syntheticToken("super"), false);
+    emitIndexed(parser, OP_SUPER_INVOKE, name);             
+    emitByte(parser, argCount);                           
   } else {                                        
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);                
+    namedVariable(parser, syntheticToken("super"), false);
+    emitIndexed(parser, OP_GET_SUPER, name);                
   }        
 }
 
-static void this_(bool canAssign) {
-  if (currentClass == NULL) {                      
-    error("Cannot use 'this' outside of a class.");
+static void this_(Parser* parser, bool canAssign) {
+  if (parser->currentClass == NULL) {                      
+    error(parser, "Cannot use 'this' outside of a class.");
     return;                                        
   }
-  variable(false);                 
+  variable(parser, false);                 
 }
 
-static void unary(bool canAssign) {                            
-  TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {                            
+  TokenType operatorType = parser->previous.type;
 
   // Compile the operand.                        
-  parsePrecedence(PREC_UNARY);                                  
+  parsePrecedence(parser, PREC_UNARY);                                  
+
+  if (foldUnary(parser, operatorType)) return;
 
   // Emit the operator instruction.              
   switch (operatorType) {   
-    case TOKEN_BANG: emitByte(OP_NOT); break;                     
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitByte(parser, OP_NOT); break;                     
+    case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
     default:                                     
       return; // Unreachable.                    
   }                                              
 }
 
-ParseRule rules[] = {                                              
+static const ParseRule rules[] = {                                              
   { grouping, call,    PREC_CALL },       // TOKEN_LEFT_PAREN      
   { NULL,     NULL,    PREC_NONE },       // TOKEN_RIGHT_PAREN     
   { NULL,     NULL,    PREC_NONE },       // TOKEN_LEFT_BRACE
@@ -632,7 +1116,7 @@ ParseRule rules[] = {
   { variable, NULL,    PREC_NONE },       // TOKEN_IDENTIFIER      
   { string,   NULL,    PREC_NONE },       // TOKEN_STRING          
   { number,   NULL,    PREC_NONE },       // TOKEN_NUMBER          
-  { NULL,     and_,    PREC_NONE },       // TOKEN_AND             
+  { NULL,     and_,    PREC_AND },        // TOKEN_AND             
   { NULL,     NULL,    PREC_NONE },       // TOKEN_CLASS           
   { NULL,     NULL,    PREC_NONE },       // TOKEN_ELSE            
   { literal,  NULL,    PREC_NONE },       // TOKEN_FALSE           
@@ -640,7 +1124,7 @@ ParseRule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_FUN             
   { NULL,     NULL,    PREC_NONE },       // TOKEN_IF              
   { literal,  NULL,    PREC_NONE },       // TOKEN_NIL             
-  { NULL,     or_,     PREC_NONE },       // TOKEN_OR              
+  { NULL,     or_,     PREC_OR },         // TOKEN_OR              
   { NULL,     NULL,    PREC_NONE },       // TOKEN_PRINT           
   { NULL,     NULL,    PREC_NONE },       // TOKEN_RETURN          
   { super_,   NULL,    PREC_NONE },       // TOKEN_SUPER           
@@ -652,296 +1136,337 @@ ParseRule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_EOF             
 };
 
-static void parsePrecedence(Precedence precedence) {
-  advance();                                                 
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+  advance(parser);                                                 
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {                                  
-    error("Expect expression.");                             
+    error(parser, "Expect expression.");                             
     return;                                                  
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;                 
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
 
   // although TOKEN_EQUAL means assignment, its precedence is PREC_NONE not PREC_ASSIGNMENT
   // so a+b=10 will exit loop at =
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();                                                    
-    ParseFn infixRule = getRule(parser.previous.type)->infix;     
-    infixRule(canAssign);                                                 
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);                                                    
+    ParseFn infixRule = getRule(parser->previous.type)->infix;     
+    infixRule(parser, canAssign);                                                 
   }
 
   // TOKEN_EQUAL can only be consumed within namedVariable
   // if it leaks here, it is an error
   // canAssign seem to make sure it errors only at outer assignment layer
   // so a+b=10 will error after a+b is parsed, not after b is parsed
-  if (canAssign && match(TOKEN_EQUAL)) {                          
-    error("Invalid assignment target.");                          
+  if (canAssign && match(parser, TOKEN_EQUAL)) {                          
+    error(parser, "Invalid assignment target.");                          
   }                                
 }
 
-static ParseRule* getRule(TokenType type) {
+static const ParseRule* getRule(TokenType type) {
   return &rules[type];                     
 }
 
-static void expression() {
-  parsePrecedence(PREC_ASSIGNMENT);      
+static void expression(Parser* parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);      
 }
 
-static void block() {                                     
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();                                        
+static void block(Parser* parser) {                                     
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);                                        
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");  
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");  
 }
 
-static void function(FunctionType type) {                       
+static void function(Parser* parser, FunctionType type) {                       
   Compiler compiler;                                            
-  initCompiler(&compiler, type);                                
-  beginScope(); 
+  initCompiler(parser, &compiler, type);                                
+  beginScope(parser); 
 
   // Compile the parameter list.                                
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!check(TOKEN_RIGHT_PAREN)) {                                    
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {                                    
     do {                                                              
-      current->function->arity++;                                     
-      if (current->function->arity > 255) {                           
-        errorAtCurrent("Cannot have more than 255 parameters.");      
+      parser->compiler->function->arity++;                                     
+      if (parser->compiler->function->arity > 255) {                           
+        errorAtCurrent(parser, "Cannot have more than 255 parameters.");      
       }
 
-      uint8_t paramConstant = parseVariable("Expect parameter name.");
-      defineVariable(paramConstant);                                  
-    } while (match(TOKEN_COMMA));                                     
+      int paramConstant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, paramConstant);                                  
+    } while (match(parser, TOKEN_COMMA));                                     
   } 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");   
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");   
 
   // The body.                                                  
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();       
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(parser);       
 
   // no need to endScope because we no longer need to use current functions locals and scopeDepth
   // for this function we only need to emit OP_RETURN, which has nothing to do with locals
   // then by calling endCompiler we will set current compiler to parent compiler, we won't emit any bytecode to current function
 
   // Create the function object.                                
-  ObjFunction* function = endCompiler();                        
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  ObjFunction* function = endCompiler(parser);                        
+  emitIndexed(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
+  // a slot past 255 takes the long capture, an upvalue index always fits
   for (int i = 0; i < function->upvalueCount; i++) {     
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);      
-    emitByte(compiler.upvalues[i].index);                
+    Upvalue* upvalue = &compiler.upvalues[i];
+    if (!upvalue->isLocal) {
+      emitBytes(parser, CAPTURE_UPVALUE, upvalue->index);
+    } else if (upvalue->index > UINT8_MAX) {
+      emitByte(parser, CAPTURE_LOCAL_LONG);
+      emitByte(parser, (upvalue->index >> 16) & 0xff);
+      emitByte(parser, (upvalue->index >> 8) & 0xff);
+      emitByte(parser, upvalue->index & 0xff);
+    } else {
+      emitBytes(parser, CAPTURE_LOCAL, upvalue->index);
+    }
   }
 }
 
-static void method() {                                    
-  consume(TOKEN_IDENTIFIER, "Expect method name.");       
-  uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser* parser) {                                    
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");       
+  int constant = identifierConstant(parser, &parser->previous);
   FunctionType type = TYPE_METHOD;
-  if (parser.previous.length == 4 &&                  
-      memcmp(parser.previous.start, "init", 4) == 0) {
+  if (parser->previous.length == 4 &&                  
+      memcmp(parser->previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;                          
   }                     
-  function(type);
-  emitBytes(OP_METHOD, constant);                         
+  function(parser, type);
+  emitIndexed(parser, OP_METHOD, constant);                         
 }
 
-static void classDeclaration() {                              
-  consume(TOKEN_IDENTIFIER, "Expect class name.");
-  Token className = parser.previous;            
-  uint8_t nameConstant = identifierConstant(&parser.previous);
-  declareVariable();
+static void classDeclaration(Parser* parser) {                              
+  consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser->previous;            
+  int nameConstant = identifierConstant(parser, &parser->previous);
+  declareVariable(parser);
 
-  emitBytes(OP_CLASS, nameConstant);                          
-  defineVariable(nameConstant);
+  emitIndexed(parser, OP_CLASS, nameConstant);                          
+  defineVariable(parser, parser->compiler->scopeDepth > 0
+                             ? 0 : globalVariable(parser, &className));
 
   ClassCompiler classCompiler;           
-  classCompiler.name = parser.previous;
+  classCompiler.name = parser->previous;
   classCompiler.hasSuperclass = false;  
-  classCompiler.enclosing = currentClass;
-  currentClass = &classCompiler; 
-
-  if (match(TOKEN_LESS)) {                               
-    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-    variable(false);
-    if (identifiersEqual(&className, &parser.previous)) {
-      error("A class cannot inherit from itself.");      
+  classCompiler.enclosing = parser->currentClass;
+  parser->currentClass = &classCompiler; 
+
+  if (match(parser, TOKEN_LESS)) {                               
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(parser, false);
+    if (identifiersEqual(&className, &parser->previous)) {
+      error(parser, "A class cannot inherit from itself.");      
     }
 
-    beginScope();                     
+    beginScope(parser);                     
     // "super" below is a constant string allocated in the DATA section of the C program
     // it's not on the C stack, so won't get freed when this function returns
     // so superclass is already on stackTop via last variable(false)
     // so this addLocal register it in the locals array
-    addLocal(syntheticToken("super"));
+    addLocal(parser, syntheticToken("super"));
     // since "super" is a local variable, so defineVariable(*) can be any number, not limited to 0
     // defineVariable must make the scopeDepth correct
-    defineVariable(0); 
+    defineVariable(parser, 0); 
 
-    namedVariable(className, false);                     
-    emitByte(OP_INHERIT);
+    namedVariable(parser, className, false);                     
+    emitByte(parser, OP_INHERIT);
     classCompiler.hasSuperclass = true;                                
   }                              
 
-  namedVariable(className, false);
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {   
-    method();                                                
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {   
+    method(parser);                                                
   }
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-  emitByte(OP_POP);
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
 
   if (classCompiler.hasSuperclass) {     
-    endScope();                          
+    endScope(parser);                          
   }
 
-  currentClass = currentClass->enclosing; 
+  parser->currentClass = parser->currentClass->enclosing; 
 }
 
-static void funDeclaration() {                            
-  uint8_t global = parseVariable("Expect function name.");
-  markInitialized();                                      
-  function(TYPE_FUNCTION);                                
-  defineVariable(global);                                 
+static void funDeclaration(Parser* parser) {                            
+  int global = parseVariable(parser, "Expect function name.");
+  markInitialized(parser);                                      
+  function(parser, TYPE_FUNCTION);                                
+  defineVariable(parser, global);                                 
 }
 
-static void expressionStatement() {                        
-  expression();                                            
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);                                        
+static void expressionStatement(Parser* parser) {                        
+  expression(parser);                                            
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(parser, OP_POP);                                        
 }
 
-static void ifStatement() {                                            
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");                 
-  expression();                                                        
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
+static void ifStatement(Parser* parser) {                                            
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");                 
+  expression(parser);                                                        
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
+
+  bool truthy;
+  if (foldCondition(parser, &truthy)) {
+    // only the branch that can run is kept, but both are still compiled
+    CodeMark start = markCode(parser);
+    statement(parser);
+    if (!truthy) discardCode(parser, start);
+
+    if (match(parser, TOKEN_ELSE)) {
+      start = markCode(parser);
+      statement(parser);
+      if (truthy) discardCode(parser, start);
+    }
+    return;
+  }
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE); // condition value is still on stack top after this
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE); // condition value is still on stack top after this
   // will pop it at the beginning of both then/else statements, even if else statement doesn't exist
 
-  emitByte(OP_POP); // pop condition value when true
-  statement();
+  emitByte(parser, OP_POP); // pop condition value when true
+  statement(parser);
 
-  int elseJump = emitJump(OP_JUMP);
-  patchJump(thenJump);
+  int elseJump = emitJump(parser, OP_JUMP);
+  patchJump(parser, thenJump);
 
-  emitByte(OP_POP); // pop condition value when false
-  if (match(TOKEN_ELSE)) statement();
+  emitByte(parser, OP_POP); // pop condition value when false
+  if (match(parser, TOKEN_ELSE)) statement(parser);
 
-  patchJump(elseJump);                                                 
+  patchJump(parser, elseJump);                                                 
 }
 
-static void varDeclaration() {                                       
-  uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser* parser) {                                       
+  int global = parseVariable(parser, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL)) {                                          
-    expression();                                                    
+  if (match(parser, TOKEN_EQUAL)) {                                          
+    expression(parser);                                                    
   } else {                                                           
-    emitByte(OP_NIL);                                                
+    emitByte(parser, OP_NIL);                                                
   }                                                                  
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-  defineVariable(global);                                            
+  defineVariable(parser, global);                                            
 }
 
-static void printStatement() {                        
-  expression();                                       
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);                                 
+static void printStatement(Parser* parser) {                        
+  expression(parser);                                       
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);                                 
 }
 
-static void returnStatement() {
-  if (current->type == TYPE_SCRIPT) {           
-    error("Cannot return from top-level code.");
+static void returnStatement(Parser* parser) {
+  if (parser->compiler->type == TYPE_SCRIPT) {           
+    error(parser, "Cannot return from top-level code.");
   }
 
-  if (match(TOKEN_SEMICOLON)) {                                
-    emitReturn();                                              
+  if (match(parser, TOKEN_SEMICOLON)) {                                
+    emitReturn(parser);                                              
   } else {
-    if (current->type == TYPE_INITIALIZER) {              
-      error("Cannot return a value from an initializer.");
+    if (parser->compiler->type == TYPE_INITIALIZER) {              
+      error(parser, "Cannot return a value from an initializer.");
     }                                                     
-    expression();                                              
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);                                       
+    expression(parser);                                              
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emitByte(parser, OP_RETURN);                                       
   }                                                            
 }
 
-static void whileStatement() {
-  int loopStart = currentChunk()->count;
-
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");   
-  expression();                                             
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+  CodeMark start = markCode(parser);
+  int loopStart = start.code;
+  parser->compiler->pendingCount = 0; // the loop jumps back here
+
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");   
+  expression(parser);                                             
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  bool truthy;
+  if (foldCondition(parser, &truthy)) {
+    // while (true) needs no exit test, while (false) no code at all
+    statement(parser);
+    if (truthy) {
+      emitLoop(parser, loopStart);
+    } else {
+      discardCode(parser, start);
+    }
+    return;
+  }
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);                
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);                
 
-  emitByte(OP_POP);                                         
-  statement();
+  emitByte(parser, OP_POP);                                         
+  statement(parser);
 
-  emitLoop(loopStart);                                              
+  emitLoop(parser, loopStart);                                              
 
-  patchJump(exitJump);                                      
-  emitByte(OP_POP);                                         
+  patchJump(parser, exitJump);                                      
+  emitByte(parser, OP_POP);                                         
 }
 
 
-static void forStatement() {
-  beginScope();
+static void forStatement(Parser* parser) {
+  beginScope(parser);
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {                        
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {                        
     // No initializer.                                 
-  } else if (match(TOKEN_VAR)) {                       
-    varDeclaration();                                  
+  } else if (match(parser, TOKEN_VAR)) {                       
+    varDeclaration(parser);                                  
   } else {                                             
-    expressionStatement();                             
+    expressionStatement(parser);                             
   }
 
-  int loopStart = currentChunk()->count;                      
+  int loopStart = currentChunk(parser)->count;                      
+  parser->compiler->pendingCount = 0; // the loop jumps back here
 
   int exitJump = -1;                                             
-  if (!match(TOKEN_SEMICOLON)) {                                 
-    expression();                                                
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  if (!match(parser, TOKEN_SEMICOLON)) {                                 
+    expression(parser);                                                
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
     // Jump out of the loop if the condition is false.           
-    exitJump = emitJump(OP_JUMP_IF_FALSE);                       
-    emitByte(OP_POP); // Condition.                              
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);                       
+    emitByte(parser, OP_POP); // Condition.                              
   }
 
-  if (!match(TOKEN_RIGHT_PAREN)) {                              
-    int bodyJump = emitJump(OP_JUMP);
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {                              
+    int bodyJump = emitJump(parser, OP_JUMP);
 
-    int incrementStart = currentChunk()->count;                 
-    expression();                                               
-    emitByte(OP_POP);                                           
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    int incrementStart = currentChunk(parser)->count;                 
+    expression(parser);                                               
+    emitByte(parser, OP_POP);                                           
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-    emitLoop(loopStart);                                        
+    emitLoop(parser, loopStart);                                        
     loopStart = incrementStart;                                 
-    patchJump(bodyJump);                                        
+    patchJump(parser, bodyJump);                                        
   }
 
-  statement();                                                
+  statement(parser);                                                
 
-  emitLoop(loopStart);
+  emitLoop(parser, loopStart);
 
   if (exitJump != -1) {            
-    patchJump(exitJump);           
-    emitByte(OP_POP); // Condition.
+    patchJump(parser, exitJump);           
+    emitByte(parser, OP_POP); // Condition.
   }
 
-  endScope();                                        
+  endScope(parser);                                        
 }
 
-static void synchronize() {                             
-  parser.panicMode = false;
+static void synchronize(Parser* parser) {                             
+  parser->panicMode = false;
 
-  while (parser.current.type != TOKEN_EOF) {            
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
+  while (parser->current.type != TOKEN_EOF) {            
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
 
-    switch (parser.current.type) {                      
+    switch (parser->current.type) {                      
       case TOKEN_CLASS:                                 
       case TOKEN_FUN:                                   
       case TOKEN_VAR:                                   
@@ -957,65 +1482,74 @@ static void synchronize() {
         ;                                               
     }                                                   
 
-    advance();                                          
+    advance(parser);                                          
   }                                                     
 }
 
-static void declaration() {
-  if (match(TOKEN_CLASS)) {     
-    classDeclaration();         
-  } else if (match(TOKEN_FUN)) {       
-    funDeclaration();           
-  } else if (match(TOKEN_VAR)) {            
-    varDeclaration();                 
+static void declaration(Parser* parser) {
+  if (match(parser, TOKEN_CLASS)) {     
+    classDeclaration(parser);         
+  } else if (match(parser, TOKEN_FUN)) {       
+    funDeclaration(parser);           
+  } else if (match(parser, TOKEN_VAR)) {            
+    varDeclaration(parser);                 
   } else {                            
-    statement();                      
-  }
-
-  if (parser.panicMode) synchronize();             
-}
-
-static void statement() {  
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_FOR)) {
-    forStatement();
-  } else if (match(TOKEN_IF)) {        
-    ifStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_WHILE)) {     
-    whileStatement();  
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();                      
-    block();                           
-    endScope();      
+    statement(parser);                      
+  }
+
+  if (parser->panicMode) synchronize(parser);             
+}
+
+static void statement(Parser* parser) {  
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {        
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOKEN_WHILE)) {     
+    whileStatement(parser);  
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);                      
+    block(parser);                           
+    endScope(parser);      
   } else {                
-    expressionStatement();
+    expressionStatement(parser);
   }                     
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
-  Compiler compiler;      
-  initCompiler(&compiler, TYPE_SCRIPT);
-
+ObjFunction* compile(VM* vm, const char* source) {
+  Parser parser;
+  parser.vm = vm;
+  initScanner(&parser.scanner, source);
+  parser.compiler = NULL;
+  parser.currentClass = NULL;
   parser.hadError = false; 
   parser.panicMode = false;
+  // the gc finds the functions being compiled through the vm
+  vm->parser = &parser;
 
-  advance();                                      
-  while (!match(TOKEN_EOF)) {
-    declaration();           
+  Compiler compiler;      
+  initCompiler(&parser, &compiler, TYPE_SCRIPT);
+
+  advance(&parser);                                      
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);           
   }
 
-  ObjFunction* function = endCompiler();   
+  ObjFunction* function = endCompiler(&parser);   
+  vm->parser = NULL;
   return parser.hadError ? NULL : function;        
 }
 
-void markCompilerRoots() {               
-  Compiler* compiler = current;          
+void markCompilerRoots(VM* vm) {               
+  if (vm->parser == NULL) return;
+
+  Compiler* compiler = vm->parser->compiler;          
   while (compiler != NULL) {             
-    markObject((Obj*)compiler->function);
+    markObject(vm, (Obj*)compiler->function);
     compiler = compiler->enclosing;      
   }                                      
-}
\ No newline at end of file
+}
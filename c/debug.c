@@ -3,32 +3,92 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"                                      
+#include "vm.h"
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);                          
 
   for (int offset = 0; offset < chunk->count;) {       
-    offset = disassembleInstruction(chunk, offset);    
+    offset = disassembleInstruction(vm, chunk, offset);    
   }                                                    
 }    
 
+static int readOperand(Chunk* chunk, int offset, int width) {
+  // operands are big endian, the _LONG forms widen the index to 3 bytes
+  int operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = (operand << 8) | chunk->code[offset + i];
+  }
+  return operand;
+}
+
 static int constantInstruction(const char* name, Chunk* chunk,
-                               int offset) {                  
-  uint8_t constant = chunk->code[offset + 1];                 
+                               int offset, int width) {                  
+  int constant = readOperand(chunk, offset + 1, width);
   printf("%-16s %4d '", name, constant);                      
   printValue(chunk->constants.values[constant]);              
   printf("'\n");
-  return offset + 2;                                              
+  return offset + 1 + width;                                              
+}
+
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk,
+                             int offset, int width) {
+  int slot = readOperand(chunk, offset + 1, width);
+  printf("%-16s %4d '%s'\n", name, slot, globalName(vm, slot)->chars);
+  return offset + 1 + width;
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk,
-                                int offset) {               
-  uint8_t constant = chunk->code[offset + 1];               
-  uint8_t argCount = chunk->code[offset + 2];               
+                                int offset, int width) {               
+  int constant = readOperand(chunk, offset + 1, width);
+  uint8_t argCount = chunk->code[offset + 1 + width];               
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);            
   printf("'\n");                                            
-  return offset + 3;                                        
+  return offset + 2 + width;                                        
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk,
+                               int offset, int width) {
+  int constant = readOperand(chunk, offset + 1, width);
+  int cache = readOperand(chunk, offset + 1 + width, 2);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 3 + width;
+}
+
+static int invokeCachedInstruction(const char* name, Chunk* chunk,
+                                   int offset, int width) {
+  int constant = readOperand(chunk, offset + 1, width);
+  uint8_t argCount = chunk->code[offset + 1 + width];
+  int cache = readOperand(chunk, offset + 2 + width, 2);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 4 + width;
+}
+
+static int localPropertyInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
 }
 
 static int simpleInstruction(const char* name, int offset) {
@@ -42,6 +102,34 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2; 
 }
 
+static int longInstruction(const char* name, Chunk* chunk, int offset) {
+  int slot = readOperand(chunk, offset + 1, 3);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 4;
+}
+
+static int closureInstruction(const char* name, Chunk* chunk,
+                              int offset, int width) {
+  int constant = readOperand(chunk, offset + 1, width);
+  offset += 1 + width;
+  printf("%-16s %4d ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+
+  ObjFunction* function = AS_FUNCTION(
+      chunk->constants.values[constant]);
+  for (int j = 0; j < function->upvalueCount; j++) {
+    int kind = chunk->code[offset];
+    int width = kind == CAPTURE_LOCAL_LONG ? 3 : 1;
+    int index = readOperand(chunk, offset + 1, width);
+    printf("%04d      |                     %s %d\n",
+           offset, kind == CAPTURE_UPVALUE ? "upvalue" : "local", index);
+    offset += 1 + width;
+  }
+
+  return offset;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk,  
                            int offset) {                              
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);           
@@ -50,18 +138,19 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk,
   return offset + 3;                                                  
 } 
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");                                                   
   } else {                                                             
-    printf("%4d ", chunk->lines[offset]);                              
+    printf("%4d ", line);                              
   } 
 
   uint8_t instruction = chunk->code[offset];          
   switch (instruction) {  
     case OP_CONSTANT:                                          
-      return constantInstruction("OP_CONSTANT", chunk, offset);
+      return constantInstruction("OP_CONSTANT", chunk, offset, 1);
     case OP_NIL:                                               
       return simpleInstruction("OP_NIL", offset);              
     case OP_TRUE:                                              
@@ -75,21 +164,21 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:                                      
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:                                          
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset, 2);
     case OP_DEFINE_GLOBAL:                                          
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset, 2);
     case OP_SET_GLOBAL:                                             
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset, 2);
     case OP_GET_UPVALUE:                                         
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);   
     case OP_SET_UPVALUE:                                         
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:                                          
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset, 1);
     case OP_SET_PROPERTY:                                          
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset, 1);
     case OP_GET_SUPER:                                             
-      return constantInstruction("OP_GET_SUPER", chunk, offset);
+      return constantInstruction("OP_GET_SUPER", chunk, offset, 1);
     case OP_EQUAL:                                   
       return simpleInstruction("OP_EQUAL", offset);  
     case OP_GREATER:                                 
@@ -119,37 +208,60 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_CALL:                                          
       return byteInstruction("OP_CALL", chunk, offset);
     case OP_INVOKE:                                        
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return invokeCachedInstruction("OP_INVOKE", chunk, offset, 1);
     case OP_SUPER_INVOKE:                                        
-      return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {                                     
-      offset++;                                            
-      uint8_t constant = chunk->code[offset++];            
-      printf("%-16s %4d ", "OP_CLOSURE", constant);        
-      printValue(chunk->constants.values[constant]);       
-      printf("\n");
-
-      ObjFunction* function = AS_FUNCTION(                       
-          chunk->constants.values[constant]);                    
-      for (int j = 0; j < function->upvalueCount; j++) {         
-        int isLocal = chunk->code[offset++];                     
-        int index = chunk->code[offset++];                       
-        printf("%04d      |                     %s %d\n",        
-               offset - 2, isLocal ? "local" : "upvalue", index);
-      }
-
-      return offset;                                       
-    }
+      return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, 1);
+    case OP_CLOSURE:
+      return closureInstruction("OP_CLOSURE", chunk, offset, 1);
     case OP_CLOSE_UPVALUE:                                 
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:                                   
       return simpleInstruction("OP_RETURN", offset);
     case OP_CLASS:                                          
-      return constantInstruction("OP_CLASS", chunk, offset);
+      return constantInstruction("OP_CLASS", chunk, offset, 1);
     case OP_INHERIT:                                        
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:                                          
-      return constantInstruction("OP_METHOD", chunk, offset);  
+      return constantInstruction("OP_METHOD", chunk, offset, 1);  
+    case OP_CONSTANT_LONG:
+      return constantInstruction("OP_CONSTANT_LONG", chunk, offset, 3);
+    case OP_GET_LOCAL_LONG:
+      return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+      return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+      return globalInstruction(vm, "OP_GET_GLOBAL_LONG", chunk, offset, 3);
+    case OP_DEFINE_GLOBAL_LONG:
+      return globalInstruction(vm, "OP_DEFINE_GLOBAL_LONG", chunk, offset, 3);
+    case OP_SET_GLOBAL_LONG:
+      return globalInstruction(vm, "OP_SET_GLOBAL_LONG", chunk, offset, 3);
+    case OP_GET_PROPERTY_LONG:
+      return propertyInstruction("OP_GET_PROPERTY_LONG", chunk, offset, 3);
+    case OP_SET_PROPERTY_LONG:
+      return propertyInstruction("OP_SET_PROPERTY_LONG", chunk, offset, 3);
+    case OP_GET_SUPER_LONG:
+      return constantInstruction("OP_GET_SUPER_LONG", chunk, offset, 3);
+    case OP_INVOKE_LONG:
+      return invokeCachedInstruction("OP_INVOKE_LONG", chunk, offset, 3);
+    case OP_SUPER_INVOKE_LONG:
+      return invokeInstruction("OP_SUPER_INVOKE_LONG", chunk, offset, 3);
+    case OP_CLOSURE_LONG:
+      return closureInstruction("OP_CLOSURE_LONG", chunk, offset, 3);
+    case OP_CLASS_LONG:
+      return constantInstruction("OP_CLASS_LONG", chunk, offset, 3);
+    case OP_METHOD_LONG:
+      return constantInstruction("OP_METHOD_LONG", chunk, offset, 3);
+    case OP_ADD_CONST:
+      return constantInstruction("OP_ADD_CONST", chunk, offset, 1);
+    case OP_ADD_LOCAL_CONST:
+      return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE:
+      return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GREATER_JUMP_IF_FALSE:
+      return jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GET_LOCAL_GET_PROPERTY:
+      return localPropertyInstruction("OP_GET_LOCAL_GET_PROPERTY", chunk,
+                                      offset);
     default:                                          
       printf("Unknown opcode %d\n", instruction);     
       return offset + 1;                              
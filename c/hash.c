@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "hash.h"
+
+uint32_t hashFnv(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < length; i++) {                     
+    hash ^= key[i];                                      
+    hash *= 16777619;                                    
+  }                                                      
+
+  return hash;                                           
+}
+
+// in the style of wyhash: the running state and the next two words
+// are folded together by a 64x64->128 bit multiply
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+  // the same 128 bit product, put together from 32 bit halves
+  uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+  uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+  uint64_t lowLow = aLow * bLow, lowHigh = aLow * bHigh;
+  uint64_t highLow = aHigh * bLow, highHigh = aHigh * bHigh;
+  uint64_t middle = (lowLow >> 32) + (uint32_t)lowHigh + (uint32_t)highLow;
+  uint64_t low = (middle << 32) | (uint32_t)lowLow;
+  uint64_t high = highHigh + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+  return low ^ high;
+#endif
+}
+
+// memcpy lets the compiler emit a plain unaligned load
+static inline uint64_t read64(const char* p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+static inline uint64_t read32(const char* p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+uint32_t hashWords(const char* key, int length) {
+  const char* p = key;
+  int remaining = length;
+  uint64_t hash = HASH_SECRET0 ^ (uint64_t)length;
+
+  while (remaining > 16) {
+    hash = mix(read64(p) ^ HASH_SECRET1, read64(p + 8) ^ hash);
+    p += 16;
+    remaining -= 16;
+  }
+
+  // the last 1 to 16 bytes, read as two words that may overlap
+  uint64_t a = 0;
+  uint64_t b = 0;
+  if (remaining > 8) {
+    a = read64(p);
+    b = read64(p + remaining - 8);
+  } else if (remaining >= 4) {
+    a = read32(p);
+    b = read32(p + remaining - 4);
+  } else if (remaining > 0) {
+    a = ((uint64_t)(uint8_t)p[0] << 16) |
+        ((uint64_t)(uint8_t)p[remaining >> 1] << 8) |
+        (uint8_t)p[remaining - 1];
+  }
+
+  hash = mix(a ^ HASH_SECRET1, b ^ hash);
+  // tables index by the low bits, so fold the high half into them
+  hash = mix(hash ^ HASH_SECRET0, (uint64_t)length ^ HASH_SECRET1);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+uint32_t hashString(const char* key, int length) {
+#ifdef FAST_HASH
+  return hashWords(key, length);
+#else
+  return hashFnv(key, length);
+#endif
+}
@@ -0,0 +1,13 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+// the classic byte at a time FNV-1a
+uint32_t hashFnv(const char* key, int length);
+// reads 16 bytes per step and mixes them with one wide multiply
+uint32_t hashWords(const char* key, int length);
+// the hash strings are interned by, picked by FAST_HASH in common.h
+uint32_t hashString(const char* key, int length);
+
+#endif
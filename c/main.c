@@ -1,13 +1,26 @@
+// mmap, open_memstream and clock_gettime are posix, not c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h> 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"   
+#include "compiler.h"
 #include "debug.h"
+#include "serialize.h"
 #include "vm.h"  
 
-static void repl() {                        
+static void repl(VM* vm) {                        
   char line[1024];                          
   for (;;) {                                
     printf("> ");
@@ -17,46 +30,391 @@ static void repl() {
       break;                                
     }                                       
 
-    interpret(line);                        
+    interpret(vm, line);                        
   }                                         
 }
 
-static char* readFile(const char* path) {                        
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {                                      
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(74);                                              
-  }  
-
-  fseek(file, 0L, SEEK_END);                                     
-  size_t fileSize = ftell(file);                                 
-  rewind(file);                                                  
-
-  char* buffer = (char*)malloc(fileSize + 1); 
-  if (buffer == NULL) {                                          
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);                                                    
-  } 
-
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {                                    
-    fprintf(stderr, "Could not read file \"%s\".\n", path);      
-    exit(74);                                                    
-  } 
-
-  buffer[bytesRead] = '\0';                                      
-
-  fclose(file);                                                  
-  return buffer;                                                 
-}   
-
-static void runFile(const char* path) {           
-  char* source = readFile(path);                  
-  InterpretResult result = interpret(source);     
-  free(source); 
-
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+typedef struct {
+  const char* chars; // Always followed by a '\0'.
+  size_t length;
+  size_t mapped;     // The length of the mapping, 0 if chars is on the heap.
+} Source;
+
+static bool readStream(VM* vm, int fd, const char* path, Source* source) {
+  // a pipe has no size up front, so the buffer grows as it fills
+  size_t capacity = 4096;
+  size_t length = 0;
+  char* buffer = NULL;
+  for (;;) {
+    if (buffer == NULL || length + 1 == capacity) {
+      if (buffer != NULL) capacity *= 2;
+      char* grown = (char*)realloc(buffer, capacity);
+      if (grown == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+      }
+      buffer = grown;
+    }
+
+    ssize_t bytesRead = read(fd, buffer + length, capacity - length - 1);
+    if (bytesRead < 0 && errno == EINTR) continue;
+    if (bytesRead < 0) {
+      fprintf(vm->errors, "Could not read file \"%s\".\n", path);
+      free(buffer);
+      return false;
+    }
+    if (bytesRead == 0) break;
+    length += (size_t)bytesRead;
+  }
+
+  buffer[length] = '\0';
+  source->chars = buffer;
+  source->length = length;
+  source->mapped = 0;
+  return true;
+}
+
+static bool readFile(VM* vm, const char* path, Source* source) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(vm->errors, "Could not open file \"%s\".\n", path);
+    return false;
+  }
+
+  // a regular file is mapped instead of copied, the scanner reads it
+  // straight from the page cache and only interned strings are copied;
+  // the '\0' after the end is the zero fill of the last page, so a file
+  // that ends right on a page boundary is read like a pipe
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 &&
+      info.st_size % sysconf(_SC_PAGESIZE) != 0) {
+    size_t size = (size_t)info.st_size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      close(fd);
+      posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+      source->chars = data;
+      source->length = size;
+      source->mapped = size;
+      return true;
+    }
+  }
+
+  bool read = readStream(vm, fd, path, source);
+  close(fd);
+  return read;
+}
+
+static void freeSource(Source* source) {
+  if (source->mapped > 0) {
+    munmap((void*)source->chars, source->mapped);
+  } else {
+    free((char*)source->chars);
+  }
+}
+
+// NULL if path could not be compiled or loaded, *status is then
+// the code to exit with
+static ObjFunction* loadFile(VM* vm, const char* path, int* status) {
+  Source source;
+  if (!readFile(vm, path, &source)) {
+    *status = 74;
+    return NULL;
+  }
+  const char* cacheDir = getenv(CACHE_DIR_ENV);
+
+  // nothing points into the source once it is compiled or loaded,
+  // so it is gone before the script runs
+  ObjFunction* function;
+  if (isBytecode((const uint8_t*)source.chars, source.length)) {
+    // compiled scripts are told apart by their header, not their name
+    function = readBytecode(vm, (const uint8_t*)source.chars,
+                            source.length);
+    freeSource(&source);
+    if (function == NULL) {
+      fprintf(vm->errors, "Could not load bytecode \"%s\".\n", path);
+    }
+  } else if (cacheDir != NULL && cacheDir[0] != '\0') {
+    function = compileCached(vm, cacheDir, source.chars);
+    freeSource(&source);
+  } else {
+    function = compile(vm, source.chars);
+    freeSource(&source);
+  }
+
+  *status = 65;
+  return function;
+}
+
+// 0 once path has run, 65 if it did not compile, 70 if it stopped
+// with a runtime error and 74 if it could not be read
+static int runFile(VM* vm, const char* path) {           
+  int status;
+  ObjFunction* function = loadFile(vm, path, &status);
+  if (function == NULL) return status;
+
+  InterpretResult result = interpretFunction(vm, function);
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
+
+static void compileFile(VM* vm, const char* path, const char* outPath) {
+  Source source;
+  if (!readFile(vm, path, &source)) exit(74);
+  ObjFunction* function = compile(vm, source.chars);
+  freeSource(&source);
+  if (function == NULL) exit(65);
+
+  FILE* file = fopen(outPath, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+    exit(74);
+  }
+
+  push(vm, OBJ_VAL(function));
+  bool written = writeBytecode(vm, function, file);
+  pop(vm);
+  if (fclose(file) != 0 || !written) {
+    fprintf(stderr, "Could not write file \"%s\".\n", outPath);
+    exit(74);
+  }
+}
+
+// --jobs runs every script in a vm of its own, on a pool of worker
+// threads. the scripts are compiled once, up front, and frozen into a
+// Program that all workers share; a worker owns one vm for all its jobs,
+// reset between them, that keeps its heap and a closure for each script
+typedef struct {
+  const char* path;
+  int status;     // what runFile() would have returned
+  double seconds;
+  int worker;
+  // what the script printed, written out in job order once all are done
+  char* output;
+  size_t outputLength;
+  char* errors;
+  size_t errorsLength;
+} Job;
+
+typedef struct Pool Pool;
+
+typedef struct {
+  pthread_t thread;
+  Pool* pool;
+  int id;
+  VM vm;
+  // the jobs [head, tail) are left to this worker, it takes them from the
+  // head and others steal from the tail, both under the lock
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+} Worker;
+
+struct Pool {
+  Program* program; // function i is NULL if job i did not compile
+  Job* jobs;
+  int jobCount;
+  Worker* workers;
+  int workerCount;
+};
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static bool stealJobs(Worker* thief) {
+  // the back half of another worker's jobs, so a steal is rare and
+  // both go on with a run of neighbouring jobs; no job is ever added,
+  // so once every other worker is empty the thief is done
+  Pool* pool = thief->pool;
+  for (int i = 1; i < pool->workerCount; i++) {
+    Worker* victim = &pool->workers[(thief->id + i) % pool->workerCount];
+    pthread_mutex_lock(&victim->lock);
+    int left = victim->tail - victim->head;
+    int tail = victim->tail;
+    victim->tail -= (left + 1) / 2;
+    int head = victim->tail;
+    pthread_mutex_unlock(&victim->lock);
+
+    if (left > 0) {
+      pthread_mutex_lock(&thief->lock);
+      thief->head = head;
+      thief->tail = tail;
+      pthread_mutex_unlock(&thief->lock);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool takeJob(Worker* worker, int* index) {
+  for (;;) {
+    pthread_mutex_lock(&worker->lock);
+    bool found = worker->head < worker->tail;
+    if (found) *index = worker->head++;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (found) return true;
+    if (!stealJobs(worker)) return false;
+  }
+}
+
+static FILE* openOutput(char** buffer, size_t* length) {
+  FILE* stream = open_memstream(buffer, length);
+  if (stream == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  return stream;
+}
+
+// compiles every job in a vm that is gone once they are frozen, a path
+// given twice is compiled once; what loading prints goes to the job
+static Program* compileJobs(Pool* pool) {
+  VM vm;
+  initVM(&vm);
+  ObjFunction** functions = calloc(pool->jobCount, sizeof(ObjFunction*));
+  if (functions == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < pool->jobCount; i++) {
+    Job* job = &pool->jobs[i];
+    vm.errors = openOutput(&job->errors, &job->errorsLength);
+    double begin = now();
+    ObjClosure* script = findScript(&vm, job->path);
+    if (script == NULL) {
+      ObjFunction* function = loadFile(&vm, job->path, &job->status);
+      if (function != NULL) script = holdScript(&vm, job->path, function);
+    }
+    if (script != NULL) {
+      functions[i] = script->function;
+      job->status = 0;
+    }
+    job->seconds = now() - begin;
+    fclose(vm.errors);
+  }
+
+  Program* program = freezeProgram(&vm, functions, pool->jobCount);
+  free(functions);
+  vm.errors = stderr;
+  freeVM(&vm);
+  return program;
+}
+
+static int runJob(VM* vm, const char* path, ObjFunction* function) {
+  ObjClosure* script = findScript(vm, path);
+  if (script == NULL) script = holdScript(vm, path, function);
+
+  InterpretResult result = runScript(vm, script);
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
+
+static void* work(void* argument) {
+  Worker* worker = (Worker*)argument;
+  Program* program = worker->pool->program;
+  VM* vm = &worker->vm;
+  initSharedVM(vm, program);
+
+  int index;
+  while (takeJob(worker, &index)) {
+    Job* job = &worker->pool->jobs[index];
+    job->worker = worker->id;
+    if (program->functions[index] == NULL) continue;
+
+    // after anything compileJobs() printed for the job
+    char* loaded = job->errors;
+    size_t loadedLength = job->errorsLength;
+    vm->output = openOutput(&job->output, &job->outputLength);
+    vm->errors = openOutput(&job->errors, &job->errorsLength);
+    fwrite(loaded, 1, loadedLength, vm->errors);
+    free(loaded);
+
+    double begin = now();
+    job->status = runJob(vm, job->path, program->functions[index]);
+    job->seconds += now() - begin;
+
+    fclose(vm->output);
+    fclose(vm->errors);
+    resetVM(vm);
+  }
+
+  vm->output = stdout;
+  vm->errors = stderr;
+  freeVM(vm);
+  return NULL;
+}
+
+// runs every path on count threads and reports what each one took,
+// the status is the highest of any job
+static int runJobs(int count, int pathCount, const char* paths[]) {
+  Pool pool;
+  pool.jobCount = pathCount;
+  pool.jobs = calloc(pathCount, sizeof(Job));
+  pool.workerCount = count < pathCount ? count : pathCount;
+  pool.workers = calloc(pool.workerCount, sizeof(Worker));
+  if (pool.jobs == NULL || pool.workers == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  for (int i = 0; i < pathCount; i++) pool.jobs[i].path = paths[i];
+
+  double begin = now();
+  pool.program = compileJobs(&pool);
+  for (int i = 0; i < pool.workerCount; i++) {
+    // every worker starts with an equal run of the jobs
+    Worker* worker = &pool.workers[i];
+    worker->pool = &pool;
+    worker->id = i;
+    worker->head = (int)((long)pathCount * i / pool.workerCount);
+    worker->tail = (int)((long)pathCount * (i + 1) / pool.workerCount);
+    pthread_mutex_init(&worker->lock, NULL);
+  }
+  for (int i = 0; i < pool.workerCount; i++) {
+    Worker* worker = &pool.workers[i];
+    if (pthread_create(&worker->thread, NULL, work, worker) != 0) {
+      fprintf(stderr, "Could not start %d workers.\n", pool.workerCount);
+      exit(71);
+    }
+  }
+  for (int i = 0; i < pool.workerCount; i++) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+  double seconds = now() - begin;
+  // a worker that is done may still be stolen from until all are
+  for (int i = 0; i < pool.workerCount; i++) {
+    pthread_mutex_destroy(&pool.workers[i].lock);
+  }
+  freeProgram(pool.program);
+
+  // the output reads as if the scripts had run one after the other
+  int status = 0;
+  for (int i = 0; i < pathCount; i++) {
+    Job* job = &pool.jobs[i];
+    // a job that did not compile has not run, nor opened its output
+    if (job->output != NULL) {
+      fwrite(job->output, 1, job->outputLength, stdout);
+    }
+    fflush(stdout);
+    fwrite(job->errors, 1, job->errorsLength, stderr);
+    free(job->output);
+    free(job->errors);
+    if (job->status > status) status = job->status;
+  }
+
+  fprintf(stderr, "-- %d jobs on %d workers in %.3f s\n",
+          pathCount, pool.workerCount, seconds);
+  for (int i = 0; i < pathCount; i++) {
+    Job* job = &pool.jobs[i];
+    fprintf(stderr, "%4d %10.3f ms  worker %-3d %s\n", job->status,
+            job->seconds * 1000, job->worker, job->path);
+  }
+
+  free(pool.jobs);
+  free(pool.workers);
+  return status;
 }
 
 // static void printSizes() {
@@ -77,17 +435,46 @@ static void runFile(const char* path) {
 
 int main(int argc, const char* argv[]) {
   // printSizes();
-  initVM();
+  VM vm;
+  initVM(&vm);
 
   if (argc == 1) {                          
-    repl();                                 
+    repl(&vm);                                 
+  } else if (argc == 2 && strcmp(argv[1], "--cache-stats") == 0) {
+    const char* cacheDir = getenv(CACHE_DIR_ENV);
+    if (cacheDir == NULL || cacheDir[0] == '\0') {
+      fprintf(stderr, "%s is not set.\n", CACHE_DIR_ENV);
+      exit(64);
+    }
+    printCacheStats(cacheDir);
   } else if (argc == 2) {                   
-    runFile(argv[1]);                       
+    int status = runFile(&vm, argv[1]);
+    if (status != 0) exit(status);
+  } else if (argc >= 4 && strcmp(argv[1], "--jobs") == 0) {
+    char* end;
+    long count = strtol(argv[2], &end, 10);
+    if (end == argv[2] || *end != '\0' || count < 1 || count > 1024) {
+      fprintf(stderr, "--jobs takes a number of workers from 1 to 1024.\n");
+      exit(64);
+    }
+    int status = runJobs((int)count, argc - 3, argv + 3);
+    if (status != 0) exit(status);
+  } else if ((argc == 3 || argc == 4) &&
+             strcmp(argv[1], "--compile") == 0) {
+    // script.lox is written to script.loxc unless told otherwise
+    char* outPath = malloc(strlen(argv[2]) + 2);
+    strcpy(outPath, argv[2]);
+    strcat(outPath, "c");
+    compileFile(&vm, argv[2], argc == 4 ? argv[3] : outPath);
+    free(outPath);
   } else {                                  
     fprintf(stderr, "Usage: clox [path]\n");
+    fprintf(stderr, "       clox --compile path [out]\n");
+    fprintf(stderr, "       clox --jobs N path...\n");
+    fprintf(stderr, "       clox --cache-stats\n");
     exit(64);                               
   }
 
-  freeVM(); 
+  freeVM(&vm); 
   return 0;                             
 }  
\ No newline at end of file
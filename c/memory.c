@@ -1,4 +1,6 @@
+#include <stdio.h>
 #include <stdlib.h>                                               
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"                                               
@@ -10,35 +12,216 @@
 #include "debug.h"                                                
 #endif
 
+#ifdef DEBUG_GC_STATS
+#include <time.h>
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
+// objects survive one collection in the nursery, then they are old
+// a minor gc runs whenever this much has been allocated since the last gc
+#define NURSERY_SIZE (256 * 1024)
+
+static void collectNursery(VM* vm);
+#ifdef GC_INCREMENTAL
+static void beginGarbage(VM* vm);
+static void stepGarbage(VM* vm);
+#endif
+
+static void collectOnAllocation(VM* vm) {
+#ifdef DEBUG_STRESS_GC
+  // every allocation runs a gc, the heap limit still decides when it is full
+  bool nurseryFull = true;
+#else
+  bool nurseryFull = vm->nurseryBytes > NURSERY_SIZE;
+#endif
+
+  void (*work)(VM* vm) = NULL;
+#ifdef GC_INCREMENTAL
+  // no minor gc may run while a full one is in progress, as both use the mark bits
+  if (vm->gcPhase != GC_IDLE) {
+    work = stepGarbage;
+  } else if (vm->bytesAllocated > vm->nextGC) {
+    work = beginGarbage;
+  } else if (nurseryFull) {
+    work = collectNursery;
+  }
+#else
+  if (vm->bytesAllocated > vm->nextGC) {
+    work = collectGarbage;
+  } else if (nurseryFull) {
+    work = collectNursery;
+  }
+#endif
+  if (work == NULL) return;
+
+#ifdef DEBUG_GC_STATS
+  clock_t start = clock();
+#endif
+  work(vm);
+#ifdef DEBUG_GC_STATS
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+  vm->gcPauses++;
+  if (pause > vm->gcMaxPause) vm->gcMaxPause = pause;
+#endif
+}
+
+static size_t blockSize(size_t size) {
+  // what an allocation of size really takes, pooled sizes are rounded up
+  if (size > POOL_MAX_SIZE) return size;
+  return (size + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE;
+}
 
-void* reallocate(void* previous, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
+static void refillPool(VM* vm, int sizeClass) {
+  PoolPage* page = (PoolPage*)malloc(POOL_PAGE_SIZE);
+  if (page == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  page->next = vm->pages;
+  vm->pages = page;
+
+  // the first granule holds the page header, the rest is cut into blocks
+  size_t size = (size_t)(sizeClass + 1) * POOL_GRANULE;
+  char* end = (char*)page + POOL_PAGE_SIZE;
+  for (char* block = (char*)page + POOL_GRANULE; block + size <= end;
+       block += size) {
+    ((PoolBlock*)block)->next = vm->freeBlocks[sizeClass];
+    vm->freeBlocks[sizeClass] = (PoolBlock*)block;
+  }
+}
+
+static void* allocateBlock(VM* vm, size_t size) {
+  if (size > POOL_MAX_SIZE) return malloc(size);
+
+  int sizeClass = (int)((size - 1) / POOL_GRANULE);
+  if (vm->freeBlocks[sizeClass] == NULL) refillPool(vm, sizeClass);
+
+  PoolBlock* block = vm->freeBlocks[sizeClass];
+  vm->freeBlocks[sizeClass] = block->next;
+  return block;
+}
+
+static void freeBlock(VM* vm, void* pointer, size_t size) {
+  if (size > POOL_MAX_SIZE) {
+    free(pointer);
+    return;
+  }
+
+  int sizeClass = (int)((size - 1) / POOL_GRANULE);
+  PoolBlock* block = (PoolBlock*)pointer;
+  block->next = vm->freeBlocks[sizeClass];
+  vm->freeBlocks[sizeClass] = block;
+}
+
+void* reallocate(VM* vm, void* previous, size_t oldSize, size_t newSize) {
+  size_t oldBlock = previous == NULL ? 0 : blockSize(oldSize);
+  size_t newBlock = newSize == 0 ? 0 : blockSize(newSize);
+  vm->bytesAllocated += newBlock - oldBlock;
   // in fact, bytes are only allocated after the final return realloc(previous, newSize)
   // this makes collectGarbage trigger by expected allocated memory, which is good
   // but info print out from collectGarbage will be strange, because it counts the to-be-allocated memory as memory allocated "before" 
 
   if (newSize > oldSize) {                                        
-#ifdef DEBUG_STRESS_GC                                            
-    collectGarbage();                                             
-#else 
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();                 
-    }
-#endif
+    if (newBlock > oldBlock) vm->nurseryBytes += newBlock - oldBlock;
+    collectOnAllocation(vm);
   }
 
   if (newSize == 0) {                                             
-    free(previous);                                               
+    if (previous != NULL) freeBlock(vm, previous, oldSize);
     return NULL;                                                  
   }                                                               
 
-  return realloc(previous, newSize);                              
+  if (previous != NULL) {
+    // a block that still fits its size class stays where it is
+    if (oldBlock == newBlock) return previous;
+    if (oldSize > POOL_MAX_SIZE && newSize > POOL_MAX_SIZE) {
+      return realloc(previous, newSize);
+    }
+  }
+
+  void* result = allocateBlock(vm, newSize);
+  if (previous != NULL) {
+    memcpy(result, previous, oldSize < newSize ? oldSize : newSize);
+    freeBlock(vm, previous, oldSize);
+  }
+  return result;
+}
+
+static void freePools(VM* vm) {
+  PoolPage* page = vm->pages;
+  while (page != NULL) {
+    PoolPage* next = page->next;
+    free(page);
+    page = next;
+  }
+
+  vm->pages = NULL;
+  for (int i = 0; i < POOL_CLASSES; i++) vm->freeBlocks[i] = NULL;
+}
+
+static void grayObject(VM* vm, Obj* object) {
+  if (vm->grayCapacity < vm->grayCount + 1) {                
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    // memory allocation of vm.grayStack bypass reallocate, therefore
+    // it will not be counted in vm.bytesAllocated
+    // as it's not an obj, and not part of any obj, it will not be garbage collected
+    // it will only be freed at the end of freeObjects
+    vm->grayStack = realloc(vm->grayStack,                   
+                           sizeof(Obj*) * vm->grayCapacity);
+  }
+  vm->grayStack[vm->grayCount++] = object;   
+}
+
+static bool isOld(VM* vm, Obj* object) {
+#ifdef GC_INCREMENTAL
+  // a survivor the sweep has not reached yet is promoted when it is, so
+  // what is stored into it until then must be remembered already
+  if (vm->gcPhase == GC_SWEEPING && object->isMarked) return true;
+#endif
+  return object->isOld;
+}
+
+void writeBarrier(VM* vm, Obj* owner, Value value) {
+  if (!IS_OBJ(value)) return;
+
+  if (isOld(vm, owner) && !AS_OBJ(value)->isOld) rememberObject(vm, owner);
+#ifdef GC_INCREMENTAL
+  // dijkstra's insertion barrier: nothing stored while marking stays white,
+  // so a black object never points at a white one
+  if (vm->gcPhase == GC_MARKING) markObject(vm, AS_OBJ(value));
+#endif
 }
 
-void markObject(Obj* object) {
+void rememberObject(VM* vm, Obj* object) {
+#ifdef GC_INCREMENTAL
+  // the owner changed in bulk, so if it may be black already it is scanned again
+  if (vm->gcPhase == GC_MARKING && object->isMarked) grayObject(vm, object);
+#endif
+  if (!isOld(vm, object) || object->isRemembered) return;
+
+  object->isRemembered = true;
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    // like vm.grayStack, kept outside of reallocate so it never triggers a gc
+    vm->remembered = realloc(vm->remembered,
+                            sizeof(Obj*) * vm->rememberedCapacity);
+  }
+  vm->remembered[vm->rememberedCount++] = object;
+}
+
+static void forgetRemembered(VM* vm) {
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->remembered[i]->isRemembered = false;
+  }
+  vm->rememberedCount = 0;
+}
+
+void markObject(VM* vm, Obj* object) {
   if (object == NULL) return;
   if (object->isMarked) return;
+  // a minor gc takes old objects as live without tracing them, what they
+  // point to in the nursery is found through vm.remembered instead
+  if (vm->minorGC && object->isOld) return;
 
 #ifdef DEBUG_LOG_GC                 
   printf("%p mark ", (void*)object);
@@ -48,30 +231,34 @@ void markObject(Obj* object) {
   object->isMarked = true; 
 
   // add marked object to vm.grayStack
-  if (vm.grayCapacity < vm.grayCount + 1) {                
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    // memory allocation of vm.grayStack bypass reallocate, therefore
-    // it will not be counted in vm.bytesAllocated
-    // as it's not an obj, and not part of any obj, it will not be garbage collected
-    // it will only be freed at the end of freeObjects
-    vm.grayStack = realloc(vm.grayStack,                   
-                           sizeof(Obj*) * vm.grayCapacity);
-  }
-  vm.grayStack[vm.grayCount++] = object;   
+  grayObject(vm, object);
 }
 
-void markValue(Value value) {
+void markValue(VM* vm, Value value) {
   if (!IS_OBJ(value)) return;
-  markObject(AS_OBJ(value)); 
+  markObject(vm, AS_OBJ(value)); 
 }
 
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
   for (int i = 0; i < array->count; i++) {
-    markValue(array->values[i]);          
+    markValue(vm, array->values[i]);          
   }                                       
 }
 
-static void blackenObject(Obj* object) {
+static void markInlineCaches(VM* vm, InlineCache* caches, int count) {
+  // cached shapes and methods are kept alive by the call site
+  // so a stale entry can never match a new shape allocated at the same address
+  for (int i = 0; i < count; i++) {
+    InlineCache* cache = &caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      markObject(vm, (Obj*)cache->entries[j].shape);
+      markObject(vm, (Obj*)cache->entries[j].transition);
+      markValue(vm, cache->entries[j].method);
+    }
+  }
+}
+
+static void blackenObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC                     
   printf("%p blacken ", (void*)object); 
   printValue(OBJ_VAL(object));          
@@ -81,46 +268,95 @@ static void blackenObject(Obj* object) {
   switch (object->type) {
     case OBJ_BOUND_METHOD: {                          
       ObjBoundMethod* bound = (ObjBoundMethod*)object;
-      markValue(bound->receiver);                     
-      markObject((Obj*)bound->method);                
+      markValue(vm, bound->receiver);                     
+      markObject(vm, (Obj*)bound->method);                
       break;                                          
     }
     
     case OBJ_CLASS: {                     
       ObjClass* klass = (ObjClass*)object;
-      markObject((Obj*)klass->name);
-      markTable(&klass->methods);      
+      markObject(vm, (Obj*)klass->name);
+      markTable(vm, &klass->methods);      
+      markObject(vm, (Obj*)klass->shape);
       break;                              
     }
 
     case OBJ_CLOSURE: {    
       // when a closure is active, its function and all upvalues are active                            
       ObjClosure* closure = (ObjClosure*)object;       
-      markObject((Obj*)closure->function);             
+      markObject(vm, (Obj*)closure->function);             
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);        
+        markObject(vm, (Obj*)closure->upvalues[i]);        
       }                                                
       break;                                           
     }
 
+    case OBJ_FIBER: {
+      // the stacks of the running fiber are in the vm and marked as roots,
+      // here they are NULL; any other fiber may be resumed again
+      ObjFiber* fiber = (ObjFiber*)object;
+      markObject(vm, (Obj*)fiber->closure);
+      markObject(vm, (Obj*)fiber->caller);
+      for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+        markValue(vm, *slot);
+      }
+      for (int i = 0; i < fiber->frameCount; i++) {
+        markObject(vm, (Obj*)fiber->frames[i].closure);
+      }
+      for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL;
+           upvalue = upvalue->next) {
+        markObject(vm, (Obj*)upvalue);
+      }
+      break;
+    }
+
     case OBJ_FUNCTION: {
       // when a function is active, its name and all constants are active                          
       ObjFunction* function = (ObjFunction*)object;
-      markObject((Obj*)function->name);            
-      markArray(&function->chunk.constants);       
+      markObject(vm, (Obj*)function->name);            
+      markArray(vm, &function->chunk.constants);       
+      markInlineCaches(vm, function->chunk.caches, function->chunk.cacheCount);
       break;                                       
     }
 
     case OBJ_INSTANCE: {                           
       ObjInstance* instance = (ObjInstance*)object;
-      markObject((Obj*)instance->klass);           
-      markTable(&instance->fields);                
+      markObject(vm, (Obj*)instance->klass);           
+      if (instance->shape != NULL) {
+        markObject(vm, (Obj*)instance->shape);
+        for (int i = 0; i < instance->shape->slotCount; i++) {
+          markValue(vm, instance->slots[i]);
+        }
+      }
+      markTable(vm, &instance->fields);                
       break;                                       
     }
 
-    case OBJ_UPVALUE:                          
-      markValue(((ObjUpvalue*)object)->closed);
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(vm, rope->left);
+      markObject(vm, rope->right);
+      markObject(vm, (Obj*)rope->flat);
+      break;
+    }
+
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markTable(vm, &shape->slots);
+      markTable(vm, &shape->transitions);
+      break;
+    }
+
+    case OBJ_UPVALUE: {
+      // an open upvalue may be written from another fiber than the one
+      // whose stack it is in, so it marks the value wherever it lives
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      markValue(vm, *upvalue->location);
+      if (upvalue->location != &upvalue->closed) {
+        markObject(vm, (Obj*)upvalue->fiber);
+      }
       break;
+    }
 
     case OBJ_NATIVE:                    
     case OBJ_STRING:                    
@@ -128,20 +364,20 @@ static void blackenObject(Obj* object) {
   }                                     
 }
 
-static void freeObject(Obj* object) {
+static void freeObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC                                        
   printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
   switch (object->type) {
     case OBJ_BOUND_METHOD:         
-      FREE(ObjBoundMethod, object);
+      FREE(vm, ObjBoundMethod, object);
       break; 
 
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
-      freeTable(&klass->methods);     
-      FREE(ObjClass, object);
+      freeTable(vm, &klass->methods);     
+      FREE(vm, ObjClass, object);
       break;                 
     }
 
@@ -149,74 +385,102 @@ static void freeObject(Obj* object) {
       // freeing a closure does not free the function
       // because a function can have many closures
       ObjClosure* closure = (ObjClosure*)object;                        
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);        
-      FREE(ObjClosure, object);
+      FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);        
+      FREE(vm, ObjClosure, object);
       break;                   
     }
+    case OBJ_FIBER: {
+      // like those of the vm, the stacks are not gc heap
+      ObjFiber* fiber = (ObjFiber*)object;
+      free(fiber->frames);
+      free(fiber->stack);
+      FREE(vm, ObjFiber, object);
+      break;
+    }
     case OBJ_FUNCTION: {                           
       ObjFunction* function = (ObjFunction*)object;
-      freeChunk(&function->chunk);                 
-      FREE(ObjFunction, object);                   
+      freeChunk(vm, &function->chunk);                 
+      FREE(vm, ObjFunction, object);                   
       break;                                       
     }
     case OBJ_INSTANCE: {
       // freeing an instance does not free the class
       // because a class can have many instances                           
       ObjInstance* instance = (ObjInstance*)object;
-      freeTable(&instance->fields);                
-      FREE(ObjInstance, object);                   
+      FREE_ARRAY(vm, Value, instance->slots, instance->slotCapacity);
+      freeTable(vm, &instance->fields);                
+      FREE(vm, ObjInstance, object);                   
       break;                                       
     }
     case OBJ_NATIVE:            
-      FREE(ObjNative, object);  
-      break;                                 
+      FREE(vm, ObjNative, object);  
+      break;  
+    case OBJ_ROPE:
+      FREE(vm, ObjRope, object);
+      break;
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(vm, &shape->slots);
+      freeTable(vm, &shape->transitions);
+      FREE(vm, ObjShape, object);
+      break;
+    }                               
     case OBJ_STRING: {    
-      // objString owns cstring, will free cstring at destruction                              
+      // the characters are part of the objString allocation
       ObjString* string = (ObjString*)object;             
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);                            
+      reallocate(vm, object, STRING_SIZE(string->length), 0);
       break;                                              
     }
     case OBJ_UPVALUE: {
-      FREE(ObjUpvalue, object);
+      FREE(vm, ObjUpvalue, object);
       break;
     }
   }                                                       
 }
 
-static void markRoots() {                                   
-  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-    markValue(*slot);                                       
+static void markRoots(VM* vm) {                                   
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(vm, *slot);                                       
   }
 
-  for (int i = 0; i < vm.frameCount; i++) {
-    markObject((Obj*)vm.frames[i].closure);
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj*)vm->frames[i].closure);
   }
 
-  for (ObjUpvalue* upvalue = vm.openUpvalues;
+  for (ObjUpvalue* upvalue = vm->openUpvalues;
        upvalue != NULL;                      
        upvalue = upvalue->next) {            
-    markObject((Obj*)upvalue);               
+    markObject(vm, (Obj*)upvalue);               
   } 
 
-  markTable(&vm.globals);
-  markCompilerRoots();
-  markObject((Obj*)vm.initString);                                                        
+  markTable(vm, &vm->globalNames);
+  markArray(vm, &vm->globalValues);
+  markTable(vm, &vm->scripts);
+  markTable(vm, &vm->natives);
+  markInlineCaches(vm, vm->sharedCaches, vm->sharedCacheCount);
+  markObject(vm, (Obj*)vm->fiber);
+  markObject(vm, (Obj*)vm->mainFiber);
+  markCompilerRoots(vm);
+  markObject(vm, (Obj*)vm->initString);                                                        
 }
 
-static void traceReferences() {                
-  while (vm.grayCount > 0) {                   
-    Obj* object = vm.grayStack[--vm.grayCount];
-    blackenObject(object);                     
+static void traceReferences(VM* vm) {                
+  while (vm->grayCount > 0) {                   
+    Obj* object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, object);                     
   }                                            
 }
 
-static void sweep() {           
+static void sweep(VM* vm) {           
+  // a minor gc stops at the first old object, as objects are only ever
+  // prepended to vm.objects everything after it is old as well
   Obj* previous = NULL;         
-  Obj* object = vm.objects;     
-  while (object != NULL) {      
+  Obj* object = vm->objects;     
+  while (object != NULL && !(vm->minorGC && object->isOld)) {      
     if (object->isMarked) {
+      // every survivor is promoted
       object->isMarked = false;     
+      object->isOld = true;
       previous = object;        
       object = object->next;    
     } else {                    
@@ -226,45 +490,153 @@ static void sweep() {
       if (previous != NULL) {   
         previous->next = object;
       } else {                  
-        vm.objects = object;    
+        vm->objects = object;    
       }                         
 
-      freeObject(unreached);    
+      freeObject(vm, unreached);    
     }                           
   }                             
 }  
 
-void collectGarbage() {
+void collectGarbage(VM* vm) {
 #ifdef DEBUG_LOG_GC       
   printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
+  size_t before = vm->bytesAllocated;
 #endif
 
-  markRoots();
-  traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  markRoots(vm);
+  traceReferences(vm);
+  tableRemoveWhite(vm, &vm->strings);
+  // remembered objects may be freed below, and after this gc nothing is young
+  forgetRemembered(vm);
+  sweep(vm);
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm->nurseryBytes = 0;
 
 #ifdef DEBUG_LOG_GC       
   printf("-- gc end\n");
   printf("   collected %ld bytes (from %ld to %ld)",
-         before - vm.bytesAllocated, before, vm.bytesAllocated);
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
 #ifndef DEBUG_STRESS_GC                                            
-  printf(" next at %ld", vm.nextGC);
+  printf(" next at %ld", vm->nextGC);
 #endif
   printf("\n");
 #endif
 }
 
-void freeObjects() {         
-  Obj* object = vm.objects;  
+static void collectNursery(VM* vm) {
+#ifdef DEBUG_LOG_GC       
+  printf("-- minor gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+
+  vm->minorGC = true;
+  markRoots(vm);
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    blackenObject(vm, vm->remembered[i]);
+  }
+  traceReferences(vm);
+  tableRemoveWhite(vm, &vm->strings);
+  forgetRemembered(vm);
+  sweep(vm);
+  vm->minorGC = false;
+
+  vm->nurseryBytes = 0;
+
+#ifdef DEBUG_LOG_GC       
+  printf("-- minor gc end\n");
+  printf("   collected %ld bytes (from %ld to %ld)\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+
+#ifdef GC_INCREMENTAL
+static void beginGarbage(VM* vm) {
+#ifdef DEBUG_LOG_GC       
+  printf("-- incremental gc begin\n");
+#endif
+
+  vm->gcPhase = GC_MARKING;
+  markRoots(vm);
+}
+
+static void finishMarking(VM* vm) {
+  // roots are written without barriers, so once the gray stack has run dry
+  // they are scanned again, which is the only step that cannot be split up
+  markRoots(vm);
+  traceReferences(vm);
+  tableRemoveWhite(vm, &vm->strings);
+  forgetRemembered(vm);
+
+  // objects allocated from here on start a new list, the old one is swept
+  vm->sweepList = vm->objects;
+  vm->sweepLink = &vm->sweepList;
+  vm->objects = NULL;
+  vm->gcPhase = GC_SWEEPING;
+}
+
+static void finishSweeping(VM* vm) {
+  // the survivors are old, so they go behind everything allocated meanwhile
+  Obj** tail = &vm->objects;
+  while (*tail != NULL) tail = &(*tail)->next;
+  *tail = vm->sweepList;
+
+  vm->sweepList = NULL;
+  vm->sweepLink = NULL;
+  vm->gcPhase = GC_IDLE;
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC       
+  printf("-- incremental gc end\n");
+  printf("   next at %ld\n", vm->nextGC);
+#endif
+}
+
+static void stepGarbage(VM* vm) {
+  int budget = GC_STEP_BUDGET;
+
+  if (vm->gcPhase == GC_MARKING) {
+    while (vm->grayCount > 0 && budget-- > 0) {
+      blackenObject(vm, vm->grayStack[--vm->grayCount]);
+    }
+    if (vm->grayCount == 0) finishMarking(vm);
+    return;
+  }
+
+  while (*vm->sweepLink != NULL && budget-- > 0) {
+    Obj* object = *vm->sweepLink;
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->isOld = true;
+      vm->sweepLink = &object->next;
+    } else {
+      *vm->sweepLink = object->next;
+      freeObject(vm, object);
+    }
+  }
+  if (*vm->sweepLink == NULL) finishSweeping(vm);
+}
+#endif
+
+void freeObjects(VM* vm) {         
+  Obj* object = vm->objects;  
   while (object != NULL) {   
     Obj* next = object->next;
-    freeObject(object);      
+    freeObject(vm, object);      
     object = next;           
   } 
 
-  free(vm.grayStack);                         
+  // an incremental gc may stop in the middle of sweeping
+  object = vm->sweepList;
+  while (object != NULL) {
+    Obj* next = object->next;
+    freeObject(vm, object);
+    object = next;
+  }
+
+  free(vm->grayStack);                         
+  free(vm->remembered);
+  // nothing may be allocated through reallocate after this
+  freePools(vm);
 }
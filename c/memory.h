@@ -3,26 +3,59 @@
 
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) \
+    reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(previous, type, oldCount, count) \
-    (type*)reallocate(previous, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, previous, type, oldCount, count) \
+    (type*)reallocate(vm, previous, sizeof(type) * (oldCount), \
         sizeof(type) * (count))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
-
-void* reallocate(void* previous, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage();
-void freeObjects();
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
+
+// blocks up to POOL_MAX_SIZE bytes come from a free list per size class,
+// refilled a page at a time. reallocate() always gets the old size, which
+// tells the class of a block, so blocks carry no header
+#define POOL_GRANULE 16
+#define POOL_CLASSES 16
+#define POOL_MAX_SIZE (POOL_GRANULE * POOL_CLASSES)
+#define POOL_PAGE_SIZE (64 * 1024)
+
+typedef struct sPoolBlock {
+  struct sPoolBlock* next;
+} PoolBlock;
+
+typedef struct sPoolPage {
+  struct sPoolPage* next;
+} PoolPage;
+
+// run right after storing value into owner: an old object that now points
+// at a young one must be scanned by the next minor gc
+#ifdef GC_INCREMENTAL
+// while an incremental gc is marking the stored value must be shaded too
+#define WRITE_BARRIER(vm, owner, value) writeBarrier(vm, owner, value)
+#else
+#define WRITE_BARRIER(vm, owner, value) \
+    do { \
+      if ((owner)->isOld && IS_OBJ(value) && !AS_OBJ(value)->isOld) { \
+        rememberObject(vm, owner); \
+      } \
+    } while (false)
+#endif
+
+// everything allocated through here belongs to the heap of vm
+void* reallocate(VM* vm, void* previous, size_t oldSize, size_t newSize);
+void writeBarrier(VM* vm, Obj* owner, Value value);
+void rememberObject(VM* vm, Obj* object);
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+void collectGarbage(VM* vm);
+void freeObjects(VM* vm);
 
 #endif   
\ No newline at end of file
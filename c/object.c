@@ -1,186 +1,398 @@
 #include <stdio.h>                                    
 #include <string.h>                                   
 
+#include "hash.h"
 #include "memory.h"                                   
 #include "object.h"
 #include "table.h"                                   
 #include "value.h"                                    
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  // all kinds of obj are allocated on the heap
-  // so they will stay active until freeObject is called    
-  Obj* object = (Obj*)reallocate(NULL, 0, size);           
+static void initObject(VM* vm, Obj* object, size_t size, ObjType type) {
   object->type = type;
   object->isMarked = false;
+  object->isOld = false;
+  object->isRemembered = false;
 
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm->objects;
+  vm->objects = object;
 
 #ifdef DEBUG_LOG_GC                                             
   printf("%p allocate %ld for %d\n", (void*)object, size, type);
 #endif
+}
 
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+  // all kinds of obj are allocated on the heap
+  // so they will stay active until freeObject is called    
+  Obj* object = (Obj*)reallocate(vm, NULL, 0, size);           
+  initObject(vm, object, size, type);
   return object;                                           
 }
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
-  ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod,              
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+  ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod,              
                                        OBJ_BOUND_METHOD);           
   bound->receiver = receiver;                                       
   bound->method = method;                                           
   return bound;                                                     
 } 
 
-ObjClass* newClass(ObjString* name) {                 
-  ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* newClass(VM* vm, ObjString* name) {                 
+  ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
   klass->name = name;
   initTable(&klass->methods); 
+  klass->shape = NULL;
+  klass->slotHint = 0;
+
+  push(vm, OBJ_VAL(klass));
+  klass->shape = newShape(vm);
+  WRITE_BARRIER(vm, (Obj*)klass, OBJ_VAL(klass->shape));
+  pop(vm);
   return klass;                                       
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+  ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {                    
     upvalues[i] = NULL;                                                 
   }
 
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
   closure->function = function;
   closure->upvalues = upvalues;                  
   closure->upvalueCount = function->upvalueCount;                               
+  closure->caches = function->sharedCaches < 0
+      ? function->chunk.caches : vm->sharedCaches + function->sharedCaches;
   return closure;                                             
 }
 
-ObjFunction* newFunction() {                                      
-  ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM* vm) {                                      
+  ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 
   function->arity = 0;
   function->upvalueCount = 0;                                            
+  function->maxSlots = 0;
   function->name = NULL;                                          
+  function->sharedCaches = -1;
   initChunk(&function->chunk);                                    
   return function;                                                
 }
 
-ObjInstance* newInstance(ObjClass* klass) {                       
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjFiber* newFiber(VM* vm, ObjClosure* closure) {
+  // the stacks are only allocated by the first resume()
+  ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+  fiber->state = FIBER_NEW;
+  fiber->closure = closure;
+  fiber->caller = NULL;
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->frameCapacity = 0;
+  fiber->stack = NULL;
+  fiber->stackTop = NULL;
+  fiber->stackCapacity = 0;
+  fiber->openUpvalues = NULL;
+  return fiber;
+}
+
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {                       
+  ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;                                        
+  instance->shape = klass->shape;
+  instance->slotCapacity = 0;
+  instance->slots = NULL;
   initTable(&instance->fields);                                   
   return instance;                                                
 }
 
-ObjNative* newNative(NativeFn function) {                 
-  ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length) {
+  ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+ObjShape* newShape(VM* vm) {
+  ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+  shape->slotCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  return shape;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+static ObjShape* addTransition(VM* vm, ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+  if (shape->transitions.count >= SHAPE_MAX_TRANSITIONS) return NULL;
+
+  // the new shape is only reachable from the stack until it is linked
+  ObjShape* child = newShape(vm);
+  push(vm, OBJ_VAL(child));
+  tableAddAll(vm, &shape->slots, &child->slots);
+  tableSet(vm, &child->slots, name, NUMBER_VAL(shape->slotCount));
+  child->slotCount = shape->slotCount + 1;
+  tableSet(vm, &shape->transitions, name, OBJ_VAL(child));
+  // a gc while filling the tables may have promoted either shape
+  rememberObject(vm, (Obj*)child);
+  rememberObject(vm, (Obj*)shape);
+  pop(vm);
+  return child;
+}
+
+void reserveSlots(VM* vm, ObjInstance* instance, int count) {
+  if (instance->slotCapacity >= count) return;
+
+  int oldCapacity = instance->slotCapacity;
+  int capacity = GROW_CAPACITY(oldCapacity);
+  // once the class has shown how many fields its instances get
+  // new instances allocate exactly that many slots up front
+  if (oldCapacity == 0 && instance->klass->slotHint >= count) {
+    capacity = instance->klass->slotHint;
+  }
+  if (capacity < count) capacity = count;
+
+  instance->slots = GROW_ARRAY(vm, instance->slots, Value,
+                               oldCapacity, capacity);
+  instance->slotCapacity = capacity;
+}
+
+static void makeDictionary(VM* vm, ObjInstance* instance) {
+  // slots stay valid and marked until every field is in the table
+  ObjShape* shape = instance->shape;
+  for (int i = 0; i < shape->slots.capacity; i++) {
+    Entry* entry = &shape->slots.entries[i];
+    if (entry->key == NULL) continue;
+    tableSet(vm, &instance->fields, entry->key,
+             instance->slots[(int)AS_NUMBER(entry->value)]);
+  }
+
+  rememberObject(vm, (Obj*)instance);
+  instance->shape = NULL;
+  FREE_ARRAY(vm, Value, instance->slots, instance->slotCapacity);
+  instance->slots = NULL;
+  instance->slotCapacity = 0;
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value) {
+  if (instance->shape == NULL) {
+    return tableGet(&instance->fields, name, value);
+  }
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot < 0) return false;
+
+  *value = instance->slots[slot];
+  return true;
+}
+
+void setField(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+  // value must be reachable by the gc, as adding a field can allocate
+  ObjShape* shape = instance->shape;
+  if (shape != NULL) {
+    int slot = shapeSlot(shape, name);
+    if (slot >= 0) {
+      instance->slots[slot] = value;
+      WRITE_BARRIER(vm, (Obj*)instance, value);
+      return;
+    }
+
+    ObjShape* next = NULL;
+    if (shape->slotCount < SHAPE_MAX_FIELDS) {
+      next = addTransition(vm, shape, name);
+    }
+
+    if (next != NULL) {
+      reserveSlots(vm, instance, next->slotCount);
+      instance->slots[shape->slotCount] = value;
+      instance->shape = next;
+      WRITE_BARRIER(vm, (Obj*)instance, value);
+      WRITE_BARRIER(vm, (Obj*)instance, OBJ_VAL(next));
+      if (next->slotCount > instance->klass->slotHint) {
+        instance->klass->slotHint = next->slotCount;
+      }
+      return;
+    }
+
+    makeDictionary(vm, instance);
+  }
+
+  tableSet(vm, &instance->fields, name, value);
+  rememberObject(vm, (Obj*)instance);
+}
+
+ObjNative* newNative(VM* vm, NativeFn function, int arity) {
+  ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function = function;                            
+  native->arity = arity;
   return native;                                          
 }
 
-static ObjString* allocateString(char* chars, int length, 
-                                 uint32_t hash) { 
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING); 
-  string->length = length;                                 
-  string->chars = chars;
+ObjString* allocateString(VM* vm, int length) {
+  // header and characters come from a single allocation
+  // the string is not an obj yet: the caller fills in chars
+  // and hands it to takeString, so the gc never sees it half built
+  ObjString* string = (ObjString*)reallocate(vm, NULL, 0, STRING_SIZE(length));
+  string->length = length;
+  string->hash = 0;
+  string->chars[length] = '\0';
+  return string;
+}
+
+static ObjString* internString(VM* vm, ObjString* string, uint32_t hash) { 
   string->hash = hash;
+  initObject(vm, (Obj*)string, STRING_SIZE(string->length), OBJ_STRING);
 
   // this can be called during compile time
   // so compiler will access vm.stack
-  push(OBJ_VAL(string));
-  tableSet(&vm.strings, string, NIL_VAL);
-  pop();
+  push(vm, OBJ_VAL(string));
+  tableSet(vm, &vm->strings, string, NIL_VAL);
+  pop(vm);
 
   return string;                                           
 }
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-
-  for (int i = 0; i < length; i++) {                     
-    hash ^= key[i];                                      
-    hash *= 16777619;                                    
-  }                                                      
-
-  return hash;                                           
-} 
-
-ObjString* takeString(char* chars, int length) {
+ObjString* takeString(VM* vm, ObjString* string) {
   // takeString is called in execution stage, to support concatenate
   // the deduplicated string is stored in vm.strings
   // but its referenece is stored on the stack, not in constants
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);                     
+  uint32_t hash = hashString(string->chars, string->length);
+  ObjString* interned = tableFindString(&vm->strings, string->chars,
+                                        string->length, hash);
   if (interned != NULL) {                                          
-    FREE_ARRAY(char, chars, length + 1);                           
+    reallocate(vm, string, STRING_SIZE(string->length), 0);
     return interned;                                               
   }
 
-  return allocateString(chars, length, hash);         
+  return internString(vm, string, hash);         
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
   // copyString is called during compile stage
   // but it affects vm.strings which should appear later only at execution stage
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
+  ObjString* interned = tableFindString(&vm->strings, chars, length,
                                         hash);                     
   if (interned != NULL) return interned; 
 
-  // ALLOCATE will call reallocate, therefore
-  // memory of heapChar* also count in vm.bytesAllocated
-  // it just does not print log "%p allocate %ld for %d"
-  // also since it's not an obj, it will not be garbage collected directly
-  // it will only be collected as part of objString
-  char* heapChars = ALLOCATE(char, length + 1);       
-  memcpy(heapChars, chars, length);                   
-  heapChars[length] = '\0';                           
+  ObjString* string = allocateString(vm, length);
+  memcpy(string->chars, chars, length);                   
+
+  return internString(vm, string, hash);         
+}
+
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+  // the rope must be reachable by the gc, as this allocates
+  if (rope->flat != NULL) return rope->flat;
 
-  return allocateString(heapChars, length, hash);         
+  ObjString* string = allocateString(vm, rope->length);
+  char* end = string->chars + rope->length;
+
+  // copy the pieces from right to left, keeping left halves on a stack
+  // `s = s + x` builds a left leaning rope, so the stack stays shallow
+  // where recursing would follow the whole chain
+  Obj** pending = NULL;
+  int capacity = 0;
+  int count = 0;
+  Obj* node = (Obj*)rope;
+  for (;;) {
+    if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat != NULL) {
+      node = (Obj*)((ObjRope*)node)->flat;
+    }
+
+    if (node->type == OBJ_ROPE) {
+      if (count == capacity) {
+        int oldCapacity = capacity;
+        capacity = GROW_CAPACITY(oldCapacity);
+        pending = GROW_ARRAY(vm, pending, Obj*, oldCapacity, capacity);
+      }
+      pending[count++] = ((ObjRope*)node)->left;
+      node = ((ObjRope*)node)->right;
+      continue;
+    }
+
+    ObjString* piece = (ObjString*)node;
+    end -= piece->length;
+    memcpy(end, piece->chars, piece->length);
+    if (count == 0) break;
+    node = pending[--count];
+  }
+  FREE_ARRAY(vm, Obj*, pending, capacity);
+
+  rope->flat = takeString(vm, string);
+  WRITE_BARRIER(vm, (Obj*)rope, OBJ_VAL(rope->flat));
+  // the pieces are no longer needed and can be collected
+  rope->left = NULL;
+  rope->right = NULL;
+  return rope->flat;
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {                         
-  ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {                         
+  ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
   upvalue->next = NULL;
+  upvalue->fiber = vm->fiber;
   return upvalue;                                             
 }
 
-static void printFunction(ObjFunction* function) {
+static void printFunction(FILE* file, ObjFunction* function) {
   if (function->name == NULL) {                   
-    printf("<script>");                           
+    fprintf(file, "<script>");                           
     return;                                       
   }
-  printf("<fn %s>", function->name->chars);       
+  fprintf(file, "<fn %s>", function->name->chars);       
 }
 
-void printObject(Value value) {       
+void printObject(FILE* file, Value value) {       
   switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:                                    
-      printFunction(AS_BOUND_METHOD(value)->method->function);
+      printFunction(file, AS_BOUND_METHOD(value)->method->function);
       break;
     case OBJ_CLASS:                              
-      printf("%s", AS_CLASS(value)->name->chars);
+      fprintf(file, "%s", AS_CLASS(value)->name->chars);
       break;
     case OBJ_CLOSURE:                            
-      printFunction(AS_CLOSURE(value)->function);
+      printFunction(file, AS_CLOSURE(value)->function);
+      break;
+    case OBJ_FIBER:
+      fprintf(file, "<fiber>");
       break;
     case OBJ_FUNCTION:                  
-      printFunction(AS_FUNCTION(value));
+      printFunction(file, AS_FUNCTION(value));
       break;
     case OBJ_INSTANCE:                                              
-      printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+      fprintf(file, "%s instance", AS_INSTANCE(value)->klass->name->chars);
       break;
     case OBJ_NATIVE:                    
-      printf("<native fn>");            
-      break;          
+      fprintf(file, "<native fn>");            
+      break;  
+    case OBJ_ROPE:
+      // the vm flattens ropes before printing them
+      if (AS_ROPE(value)->flat != NULL) {
+        fprintf(file, "%s", AS_ROPE(value)->flat->chars);
+      } else {
+        fprintf(file, "rope");
+      }
+      break;
+    case OBJ_SHAPE:
+      fprintf(file, "shape");
+      break;        
     case OBJ_STRING:                  
-      printf("%s", AS_CSTRING(value));
+      fprintf(file, "%s", AS_CSTRING(value));
       break;
     case OBJ_UPVALUE:                 
-      printf("upvalue");              
+      fprintf(file, "upvalue");              
       break;
   }                                   
 } 
\ No newline at end of file
@@ -11,17 +11,25 @@
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)       isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value)         isObjType(value, OBJ_FIBER)
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)          isObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
+// anything the language treats as a string, flat or not
+#define IS_TEXT(value)          (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)         ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)       ((ObjClosure*)AS_OBJ(value)) 
+#define AS_FIBER(value)         ((ObjFiber*)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value)         ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))         
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
 
@@ -29,9 +37,12 @@ typedef enum {
   OBJ_BOUND_METHOD,
   OBJ_CLASS,
   OBJ_CLOSURE,
+  OBJ_FIBER,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE   
 } ObjType; 
@@ -39,6 +50,8 @@ typedef enum {
 struct sObj {        
   ObjType type;
   bool isMarked;
+  bool isOld;        // survived a collection, minor gcs take it as live
+  bool isRemembered; // old and in vm.remembered
   struct sObj* next;      
 };
 
@@ -49,29 +62,53 @@ typedef struct {
   Obj obj;          
   int arity;
   int upvalueCount;        
+  int maxSlots;      // stack slots a call takes at most, callee included
   Chunk chunk;
   ObjString* name;  
+  // -1, or for a function frozen into a Program, where its inline caches
+  // start in vm.sharedCaches of each vm running it
+  int sharedCaches;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+typedef Value (*NativeFn)(VM* vm, int argCount, Value* args);
 
 typedef struct {                                     
   Obj obj;                                           
   NativeFn function;                                 
+  int arity; // -1 takes any number of arguments
 } ObjNative;
 
+// the characters live in the same allocation as the header
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
 struct sObjString {
   Obj obj;         
   int length;      
-  char* chars;
   uint32_t hash;     
+  char chars[];
 };
 
+// concatenations at least this long build a rope instead of copying
+#define ROPE_MIN_LENGTH 64
+
+// a concatenation whose characters have not been copied yet
+// it is flattened into an interned objString the first time
+// the characters are needed, i.e. when compared or printed
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;         // objString or objRope, NULL once flattened
+  Obj* right;
+  ObjString* flat;   // NULL until flattened
+} ObjRope;
+
 typedef struct sUpvalue {
   Obj obj;               
   Value* location;
   Value closed;
   struct sUpvalue* next;       
+  // whose stack location is in while open, kept alive by the upvalue
+  struct sObjFiber* fiber;
 } ObjUpvalue; 
 
 typedef struct {        
@@ -79,18 +116,64 @@ typedef struct {
   ObjFunction* function;
   ObjUpvalue** upvalues;
   int upvalueCount; 
+  // those of the function, or of this vm if the function is frozen
+  InlineCache* caches;
 } ObjClosure;
 
+typedef enum {
+  FIBER_NEW,       // not resumed yet, so it has no stacks
+  FIBER_SUSPENDED, // yielded, its stacks are saved in it
+  FIBER_RUNNING,   // running, or waiting for a fiber it resumed
+  FIBER_DONE       // returned or ran into an error
+} FiberState;
+
+// a call stack of its own, which runs from resume() until yield();
+// the one running has its stacks in the vm, see switchFiber(), all the
+// others keep theirs here, where the gc looks for them
+typedef struct sObjFiber {
+  Obj obj;
+  FiberState state;
+  ObjClosure* closure;       // what it runs, with the first resume() value
+  struct sObjFiber* caller;  // resumed it and waits for it to yield
+  struct sCallFrame* frames;
+  int frameCount;
+  int frameCapacity;
+  Value* stack;
+  Value* stackTop;
+  int stackCapacity;
+  ObjUpvalue* openUpvalues;
+} ObjFiber;
+
+// an instance layout: which field lives in which slot
+// instances that add the same fields in the same order share a shape
+// shapes form a tree rooted at the empty shape of each class,
+// so a shape also tells which class the instance belongs to
+typedef struct sObjShape {
+  Obj obj;
+  int slotCount;
+  Table slots;       // field name -> NUMBER_VAL(slot index)
+  Table transitions; // field name -> OBJ_VAL(shape after adding that field)
+} ObjShape;
+
+// past these limits an instance leaves the shape tree for dictionary mode
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 32
+
 typedef struct sObjClass {                    
   Obj obj;                                    
   ObjString* name;
   Table methods;                            
+  ObjShape* shape;   // empty shape every new instance starts with
+  int slotHint;      // most fields an instance of this class has had, to size new slot arrays
 } ObjClass;
 
 typedef struct {                    
   Obj obj;                          
   ObjClass* klass;                  
-  Table fields; 
+  ObjShape* shape;   // NULL in dictionary mode
+  int slotCapacity;
+  Value* slots;      // field values in shape order
+  Table fields;      // field name -> value, only used in dictionary mode
 } ObjInstance;
 
 typedef struct {                    
@@ -99,16 +182,25 @@ typedef struct {
   ObjClosure* method;               
 } ObjBoundMethod; 
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
-ObjClass* newClass(ObjString* name);
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction();
-ObjInstance* newInstance(ObjClass* klass);
-ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(Value* slot); 
-void printObject(Value value);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+ObjClass* newClass(VM* vm, ObjString* name);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjFunction* newFunction(VM* vm);
+ObjFiber* newFiber(VM* vm, ObjClosure* closure);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+ObjNative* newNative(VM* vm, NativeFn function, int arity);
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length);
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+ObjShape* newShape(VM* vm);
+int shapeSlot(ObjShape* shape, ObjString* name);
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+void setField(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+void reserveSlots(VM* vm, ObjInstance* instance, int count);
+ObjString* allocateString(VM* vm, int length);
+ObjString* takeString(VM* vm, ObjString* string);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot); 
+void printObject(FILE* file, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;   
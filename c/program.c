@@ -0,0 +1,241 @@
+// mmap and mprotect are posix, MAP_ANONYMOUS is not until posix 2024
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "program.h"
+#include "vm.h"
+
+// frozen objects are allocated from pages of at least this many bytes
+#define PAGE_MIN (64 * 1024)
+// every object starts this aligned, which suits any of its fields
+#define ALIGNMENT 16
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+typedef struct sPage {
+  struct sPage* next;
+  size_t size;
+  size_t used;
+} Page;
+
+// an object of the vm and its frozen copy
+typedef struct {
+  Obj* from;
+  Obj* to;
+} Copy;
+
+// the state of one freezeProgram(), outside of any gc heap
+typedef struct {
+  Program* program;
+  // open addressing by the address of the original, so each string and
+  // function is copied once and equal strings stay one object
+  Copy* copies;
+  int copyCount;
+  int copyCapacity;
+  int stringCapacity;
+} Freezer;
+
+static void* checked(void* pointer) {
+  if (pointer == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  return pointer;
+}
+
+static void* allocateFrozen(Freezer* freezer, size_t size) {
+  Program* program = freezer->program;
+  size = ALIGN(size);
+  Page* page = program->pages;
+  if (page == NULL || page->used + size > page->size) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t bytes = ALIGN(sizeof(Page)) + size;
+    if (bytes < PAGE_MIN) bytes = PAGE_MIN;
+    bytes = (bytes + pageSize - 1) / pageSize * pageSize;
+
+    page = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    checked(page == MAP_FAILED ? NULL : page);
+    page->next = program->pages;
+    page->size = bytes;
+    page->used = ALIGN(sizeof(Page));
+    program->pages = page;
+    program->bytes += bytes;
+  }
+
+  void* object = (char*)page + page->used;
+  page->used += size;
+  return object;
+}
+
+static uint32_t hashAddress(Obj* object) {
+  return (uint32_t)((uintptr_t)object >> 4) * 2654435769u;
+}
+
+static Obj* findCopy(Freezer* freezer, Obj* object) {
+  if (freezer->copyCapacity == 0) return NULL;
+  uint32_t index = hashAddress(object) & (freezer->copyCapacity - 1);
+  for (;;) {
+    Copy* copy = &freezer->copies[index];
+    if (copy->from == NULL) return NULL;
+    if (copy->from == object) return copy->to;
+    index = (index + 1) & (freezer->copyCapacity - 1);
+  }
+}
+
+static void addCopy(Freezer* freezer, Obj* from, Obj* to) {
+  if ((freezer->copyCount + 1) * 4 > freezer->copyCapacity * 3) {
+    Copy* old = freezer->copies;
+    int oldCapacity = freezer->copyCapacity;
+    freezer->copyCapacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+    freezer->copies = checked(calloc(freezer->copyCapacity, sizeof(Copy)));
+    freezer->copyCount = 0;
+    for (int i = 0; i < oldCapacity; i++) {
+      if (old[i].from != NULL) addCopy(freezer, old[i].from, old[i].to);
+    }
+    free(old);
+  }
+
+  uint32_t index = hashAddress(from) & (freezer->copyCapacity - 1);
+  while (freezer->copies[index].from != NULL) {
+    index = (index + 1) & (freezer->copyCapacity - 1);
+  }
+  freezer->copies[index].from = from;
+  freezer->copies[index].to = to;
+  freezer->copyCount++;
+}
+
+static void freezeHeader(Obj* object) {
+  // marked, old and remembered for good, so no collection of any vm
+  // ever writes to it, frees it or looks inside it
+  object->isMarked = true;
+  object->isOld = true;
+  object->isRemembered = true;
+  object->next = NULL;
+}
+
+static ObjString* freezeString(Freezer* freezer, ObjString* string) {
+  Obj* copy = findCopy(freezer, (Obj*)string);
+  if (copy != NULL) return (ObjString*)copy;
+
+  ObjString* frozen = allocateFrozen(freezer, STRING_SIZE(string->length));
+  memcpy(frozen, string, STRING_SIZE(string->length));
+  freezeHeader(&frozen->obj);
+  addCopy(freezer, (Obj*)string, (Obj*)frozen);
+
+  Program* program = freezer->program;
+  if (program->stringCount == freezer->stringCapacity) {
+    freezer->stringCapacity = GROW_CAPACITY(freezer->stringCapacity);
+    program->strings = checked(realloc(program->strings,
+        sizeof(ObjString*) * freezer->stringCapacity));
+  }
+  program->strings[program->stringCount++] = frozen;
+  return frozen;
+}
+
+static void* freezeArray(Freezer* freezer, const void* array, size_t size) {
+  if (size == 0) return NULL;
+  void* frozen = allocateFrozen(freezer, size);
+  memcpy(frozen, array, size);
+  return frozen;
+}
+
+static ObjFunction* freezeFunction(Freezer* freezer, ObjFunction* function);
+
+static Value freezeConstant(Freezer* freezer, Value value) {
+  // the compiler only makes number, string and function constants
+  if (IS_STRING(value)) {
+    return OBJ_VAL(freezeString(freezer, AS_STRING(value)));
+  }
+  if (IS_FUNCTION(value)) {
+    return OBJ_VAL(freezeFunction(freezer, AS_FUNCTION(value)));
+  }
+  return value;
+}
+
+static ObjFunction* freezeFunction(Freezer* freezer, ObjFunction* function) {
+  Obj* copy = findCopy(freezer, (Obj*)function);
+  if (copy != NULL) return (ObjFunction*)copy;
+
+  ObjFunction* frozen = allocateFrozen(freezer, sizeof(ObjFunction));
+  *frozen = *function;
+  freezeHeader(&frozen->obj);
+  addCopy(freezer, (Obj*)function, (Obj*)frozen);
+  if (function->name != NULL) {
+    frozen->name = freezeString(freezer, function->name);
+  }
+
+  Chunk* from = &function->chunk;
+  Chunk* chunk = &frozen->chunk;
+  chunk->code = freezeArray(freezer, from->code, from->count);
+  chunk->capacity = from->count;
+  chunk->lines = freezeArray(freezer, from->lines,
+                             sizeof(LineStart) * from->lineCount);
+  chunk->lineCapacity = from->lineCount;
+  chunk->constants.capacity = from->constants.count;
+  chunk->constants.values = NULL;
+  if (from->constants.count > 0) {
+    chunk->constants.values = allocateFrozen(freezer,
+        sizeof(Value) * from->constants.count);
+  }
+  for (int i = 0; i < from->constants.count; i++) {
+    chunk->constants.values[i] =
+        freezeConstant(freezer, from->constants.values[i]);
+  }
+
+  // the caches change as the code runs, so each vm has its own
+  chunk->caches = NULL;
+  chunk->cacheCapacity = 0;
+  frozen->sharedCaches = freezer->program->cacheCount;
+  freezer->program->cacheCount += chunk->cacheCount;
+  return frozen;
+}
+
+Program* freezeProgram(VM* vm, ObjFunction** functions, int count) {
+  Program* program = checked(calloc(1, sizeof(Program)));
+  Freezer freezer = {program, NULL, 0, 0, 0};
+
+  // the code reads and writes globals by slot, so the names come along
+  // and every vm running it gives them the same slots
+  program->globalCount = vm->globalValues.count;
+  program->globals = checked(calloc(program->globalCount + 1,
+                                    sizeof(ObjString*)));
+  for (int i = 0; i < vm->globalNames.capacity; i++) {
+    Entry* entry = &vm->globalNames.entries[i];
+    if (entry->key == NULL) continue;
+    program->globals[(int)AS_NUMBER(entry->value)] =
+        freezeString(&freezer, entry->key);
+  }
+
+  program->functionCount = count;
+  program->functions = checked(calloc(count + 1, sizeof(ObjFunction*)));
+  for (int i = 0; i < count; i++) {
+    if (functions[i] == NULL) continue;
+    program->functions[i] = freezeFunction(&freezer, functions[i]);
+  }
+  free(freezer.copies);
+
+  // nothing writes to the pages from here on, a bug that tries faults
+  for (Page* page = program->pages; page != NULL; page = page->next) {
+    mprotect(page, page->size, PROT_READ);
+  }
+  return program;
+}
+
+void freeProgram(Program* program) {
+  Page* page = program->pages;
+  while (page != NULL) {
+    Page* next = page->next;
+    munmap(page, page->size);
+    page = next;
+  }
+
+  free(program->functions);
+  free(program->globals);
+  free(program->strings);
+  free(program);
+}
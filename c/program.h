@@ -0,0 +1,36 @@
+#ifndef clox_program_h
+#define clox_program_h
+
+#include "common.h"
+#include "object.h"
+
+// compiled scripts frozen outside of any vm, so that any number of vms,
+// on any threads, run them at once without compiling or copying them:
+// the functions with their code and constants, and every string those use,
+// are copied into pages that are then made read only and that no gc frees
+// or even marks. what changes as the code runs stays in each vm: closures,
+// upvalues and the inline caches, see initSharedVM()
+typedef struct {
+  // the frozen copy of each function given to freezeProgram(), in order
+  int functionCount;
+  ObjFunction** functions;
+  // the global names by the slot the code was compiled with
+  int globalCount;
+  ObjString** globals;
+  // every frozen string, interned by a vm before any string of its own
+  int stringCount;
+  ObjString** strings;
+  // inline caches of all the functions, see ObjFunction.sharedCaches
+  int cacheCount;
+  struct sPage* pages;
+  size_t bytes; // in pages
+} Program;
+
+// freezes functions compiled or loaded in vm, NULL entries stay NULL and
+// a function given twice is frozen once; vm is not changed and may be
+// freed right after, the program lives until freeProgram()
+Program* freezeProgram(VM* vm, ObjFunction** functions, int count);
+// only once no vm runs the program any more
+void freeProgram(Program* program);
+
+#endif
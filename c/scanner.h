@@ -34,7 +34,14 @@ typedef struct {
   int line;                          
 } Token;   
 
-void initScanner(const char* source);
-Token scanToken();
+// the scanning position in one source, owned by whoever compiles it
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
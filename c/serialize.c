@@ -0,0 +1,579 @@
+// mmap is posix, not c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "serialize.h"
+#include "table.h"
+#include "vm.h"
+
+// the tag byte in front of every constant
+typedef enum {
+  CONSTANT_NUMBER,   // followed by the 8 bytes of the double
+  CONSTANT_STRING,   // followed by a string index
+  CONSTANT_FUNCTION  // followed by the function itself
+} ConstantTag;
+
+// nested deeper than any script would be, so a bad file can't exhaust the c stack
+#define MAX_NESTING UINT8_COUNT
+
+// scratch memory outside of the gc heap, like vm.grayStack
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} Buffer;
+
+typedef struct {
+  VM* vm;
+  Buffer strings;  // the string section, without its count
+  int stringCount;
+  Table indexes;   // string -> NUMBER_VAL(index in the string section)
+  Buffer body;     // the globals and the script
+} Writer;
+
+static uint32_t checksum(const uint8_t* bytes, size_t count) {
+  // FNV-1a over unsigned bytes, so it is the same wherever char is signed
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < count; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static void writeBytes(Buffer* buffer, const void* bytes, size_t count) {
+  if (buffer->capacity < buffer->count + count) {
+    while (buffer->capacity < buffer->count + count) {
+      buffer->capacity = GROW_CAPACITY(buffer->capacity);
+    }
+    buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    if (buffer->bytes == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(1);
+    }
+  }
+
+  memcpy(buffer->bytes + buffer->count, bytes, count);
+  buffer->count += count;
+}
+
+static void writeU8(Buffer* buffer, uint8_t value) {
+  writeBytes(buffer, &value, 1);
+}
+
+static void writeU32(Buffer* buffer, uint32_t value) {
+  uint8_t bytes[4];
+  for (int i = 0; i < 4; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+  writeBytes(buffer, bytes, 4);
+}
+
+static void writeU64(Buffer* buffer, uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+  writeBytes(buffer, bytes, 8);
+}
+
+static uint32_t stringIndex(Writer* writer, ObjString* string) {
+  // every string is written once, however often it is referenced
+  Value index;
+  if (tableGet(&writer->indexes, string, &index)) {
+    return (uint32_t)AS_NUMBER(index);
+  }
+
+  tableSet(writer->vm, &writer->indexes, string,
+           NUMBER_VAL(writer->stringCount));
+  writeU32(&writer->strings, string->length);
+  writeBytes(&writer->strings, string->chars, string->length);
+  return writer->stringCount++;
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  // u32 name, the string index + 1 or 0 for the script
+  // u32 arity, upvalue count and max slots
+  // u32 code length, then the code
+  // u32 line runs, then the u32 offset and u32 line of each
+  // u32 inline caches, which start out empty again when loaded
+  // u32 constants, then a tag byte and the constant itself
+  Buffer* out = &writer->body;
+  writeU32(out, function->name == NULL
+                    ? 0 : stringIndex(writer, function->name) + 1);
+  writeU32(out, function->arity);
+  writeU32(out, function->upvalueCount);
+  writeU32(out, function->maxSlots);
+
+  Chunk* chunk = &function->chunk;
+  writeU32(out, chunk->count);
+  writeBytes(out, chunk->code, chunk->count);
+  writeU32(out, chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    writeU32(out, chunk->lines[i].offset);
+    writeU32(out, chunk->lines[i].line);
+  }
+  writeU32(out, chunk->cacheCount);
+
+  writeU32(out, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_NUMBER(value)) {
+      double number = AS_NUMBER(value);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      writeU8(out, CONSTANT_NUMBER);
+      writeU64(out, bits);
+    } else if (IS_STRING(value)) {
+      writeU8(out, CONSTANT_STRING);
+      writeU32(out, stringIndex(writer, AS_STRING(value)));
+    } else {
+      // the compiler puts nothing else in the constant table
+      writeU8(out, CONSTANT_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(value));
+    }
+  }
+}
+
+bool writeBytecode(VM* vm, ObjFunction* function, FILE* file) {
+  Writer writer = {vm, {NULL, 0, 0}, 0, {0}, {NULL, 0, 0}};
+  initTable(&writer.indexes);
+
+  // the name of every global slot goes along, so a vm that numbers
+  // its globals differently can renumber the operands on loading
+  int globalCount = vm->globalValues.count;
+  ObjString** names = malloc(sizeof(ObjString*) * (globalCount + 1));
+  for (int i = 0; i < vm->globalNames.capacity; i++) {
+    Entry* entry = &vm->globalNames.entries[i];
+    if (entry->key != NULL) names[(int)AS_NUMBER(entry->value)] = entry->key;
+  }
+  writeU32(&writer.body, globalCount);
+  for (int i = 0; i < globalCount; i++) {
+    writeU32(&writer.body, stringIndex(&writer, names[i]));
+  }
+  free(names);
+
+  writeFunction(&writer, function);
+
+  Buffer payload = {NULL, 0, 0};
+  writeU32(&payload, writer.stringCount);
+  writeBytes(&payload, writer.strings.bytes, writer.strings.count);
+  writeBytes(&payload, writer.body.bytes, writer.body.count);
+
+  Buffer header = {NULL, 0, 0};
+  writeBytes(&header, BYTECODE_MAGIC, 4);
+  writeU32(&header, BYTECODE_VERSION);
+  writeU32(&header, checksum(payload.bytes, payload.count));
+
+  bool written =
+      fwrite(header.bytes, 1, header.count, file) == header.count &&
+      fwrite(payload.bytes, 1, payload.count, file) == payload.count;
+
+  free(header.bytes);
+  free(payload.bytes);
+  free(writer.strings.bytes);
+  free(writer.body.bytes);
+  freeTable(vm, &writer.indexes);
+  return written;
+}
+
+typedef struct {
+  VM* vm;
+  const uint8_t* bytes;
+  size_t count;
+  size_t position;
+  bool failed;
+  int depth;
+  // the string section is only indexed up front, a string is interned the
+  // first time it is referenced and from then on stays reachable from there
+  uint32_t stringCount;
+  const uint8_t** stringStarts;
+  uint32_t* stringLengths;
+  ObjString** interned;
+  // slot of each global of the file in this vm
+  uint32_t globalCount;
+  int* globalSlots;
+} Reader;
+
+static bool ensure(Reader* reader, size_t count) {
+  if (reader->failed || reader->count - reader->position < count) {
+    reader->failed = true;
+    return false;
+  }
+  return true;
+}
+
+static uint8_t readU8(Reader* reader) {
+  if (!ensure(reader, 1)) return 0;
+  return reader->bytes[reader->position++];
+}
+
+static uint32_t readU32(Reader* reader) {
+  if (!ensure(reader, 4)) return 0;
+  const uint8_t* bytes = reader->bytes + reader->position;
+  reader->position += 4;
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+         ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t readU64(Reader* reader) {
+  uint64_t low = readU32(reader);
+  uint64_t high = readU32(reader);
+  return low | (high << 32);
+}
+
+static uint32_t readCount(Reader* reader, size_t elementSize) {
+  // a count can't promise more elements than there are bytes left
+  uint32_t count = readU32(reader);
+  if (count > INT_MAX || !ensure(reader, count * elementSize)) {
+    reader->failed = true;
+    return 0;
+  }
+  return count;
+}
+
+static ObjString* stringAt(Reader* reader, uint32_t index) {
+  // the caller makes the string reachable before anything else allocates
+  if (reader->failed || index >= reader->stringCount) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  if (reader->interned[index] == NULL) {
+    reader->interned[index] = copyString(reader->vm,
+        (const char*)reader->stringStarts[index],
+        (int)reader->stringLengths[index]);
+  }
+  return reader->interned[index];
+}
+
+static int readOperand(uint8_t* code, int width) {
+  int operand = 0;
+  for (int i = 0; i < width; i++) operand = (operand << 8) | code[i];
+  return operand;
+}
+
+static bool isConstant(Chunk* chunk, int index, ObjType type) {
+  return index < chunk->constants.count &&
+         isObjType(chunk->constants.values[index], type);
+}
+
+static bool renumberGlobal(Reader* reader, uint8_t* operand, int width) {
+  int slot = readOperand(operand, width);
+  if ((uint32_t)slot >= reader->globalCount) return false;
+
+  slot = reader->globalSlots[slot];
+  if (slot >= 1 << (8 * width)) return false;
+  for (int i = width - 1; i >= 0; i--) {
+    operand[i] = slot & 0xff;
+    slot >>= 8;
+  }
+  return true;
+}
+
+static bool checkOperands(Reader* reader, ObjFunction* function, int offset,
+                          int length) {
+  // every operand that indexes something must be in range
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = chunk->code;
+  uint8_t* operands = code + offset + 1;
+  switch (code[offset]) {
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      return operands[0] < function->upvalueCount;
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+      return isConstant(chunk, readOperand(operands, length - 1), OBJ_STRING);
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      return renumberGlobal(reader, operands, length - 1);
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      return readOperand(operands, length - 1) < chunk->constants.count;
+    case OP_ADD_CONST:
+      return operands[0] < chunk->constants.count;
+    case OP_ADD_LOCAL_CONST:
+      return operands[1] < chunk->constants.count;
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:
+      return isConstant(chunk, readOperand(operands, length - 2), OBJ_STRING);
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG: {
+      int width = length - 3;
+      return isConstant(chunk, readOperand(operands, width), OBJ_STRING) &&
+             readOperand(operands + width, 2) < chunk->cacheCount;
+    }
+    case OP_INVOKE:
+    case OP_INVOKE_LONG: {
+      int width = length - 4;
+      return isConstant(chunk, readOperand(operands, width), OBJ_STRING) &&
+             readOperand(operands + width + 1, 2) < chunk->cacheCount;
+    }
+    case OP_GET_LOCAL_GET_PROPERTY:
+      return isConstant(chunk, operands[1], OBJ_STRING) &&
+             readOperand(operands + 2, 2) < chunk->cacheCount;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      // captures of upvalues come from this function's upvalues
+      for (int i = code[offset] == OP_CLOSURE ? 1 : 3; i < length - 1;) {
+        if (operands[i] > CAPTURE_LOCAL_LONG ||
+            (operands[i] == CAPTURE_UPVALUE &&
+             operands[i + 1] >= function->upvalueCount)) {
+          return false;
+        }
+        i += operands[i] == CAPTURE_LOCAL_LONG ? 4 : 2;
+      }
+      return true;
+    default:
+      return true;
+  }
+}
+
+static bool checkCode(Reader* reader, ObjFunction* function) {
+  // a damaged file is caught by the checksum, these checks keep a file that
+  // was produced by something other than the compiler from reading or
+  // writing out of bounds: every instruction is decoded and its operands
+  // checked, global slots are renumbered on the way, and then the stack is
+  // followed through every path so slots and operands are never above the
+  // top and it never outgrows the window the vm sizes from maxSlots; what
+  // kind of value is on the stack isn't followed, every instruction checks
+  // the types of the values it takes before it casts them
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = chunk->code;
+  int offset = 0;
+  while (offset < chunk->count) {
+    // the length of a closure depends on its function
+    uint8_t* operands = code + offset + 1;
+    int left = chunk->count - offset - 1;
+    if ((code[offset] == OP_CLOSURE && left < 1) ||
+        (code[offset] == OP_CLOSURE_LONG && left < 3)) {
+      return false;
+    }
+    if (code[offset] == OP_CLOSURE || code[offset] == OP_CLOSURE_LONG) {
+      int width = code[offset] == OP_CLOSURE ? 1 : 3;
+      if (!isConstant(chunk, readOperand(operands, width), OBJ_FUNCTION)) {
+        return false;
+      }
+    }
+
+    StackEffect effect;
+    int length = instructionLength(chunk, offset);
+    if (length - 1 > left || !stackEffect(chunk, offset, &effect) ||
+        !checkOperands(reader, function, offset, length)) {
+      return false;
+    }
+    offset += length;
+  }
+
+  int depth = maxStackDepth(chunk, function->arity + 1);
+  return depth >= 0 && depth <= function->maxSlots;
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+  if (reader->depth == MAX_NESTING) {
+    reader->failed = true;
+    return NULL;
+  }
+  reader->depth++;
+
+  ObjFunction* function = newFunction(reader->vm);
+  push(reader->vm, OBJ_VAL(function));
+
+  uint32_t name = readU32(reader);
+  if (name != 0) {
+    function->name = stringAt(reader, name - 1);
+    if (function->name != NULL) {
+      WRITE_BARRIER(reader->vm, (Obj*)function, OBJ_VAL(function->name));
+    }
+  }
+  function->arity = (int)readU32(reader);
+  function->upvalueCount = (int)readU32(reader);
+  function->maxSlots = (int)readU32(reader);
+  if (function->arity < 0 || function->arity > UINT8_MAX ||
+      function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT ||
+      function->maxSlots <= function->arity ||
+      function->maxSlots > UINT24_MAX + 1) {
+    reader->failed = true;
+  }
+
+  // code and lines are copied straight out of the file
+  Chunk* chunk = &function->chunk;
+  int count = (int)readCount(reader, 1);
+  if (!reader->failed) {
+    chunk->code = GROW_ARRAY(reader->vm, chunk->code, uint8_t, 0, count);
+    chunk->capacity = count;
+    chunk->count = count;
+    memcpy(chunk->code, reader->bytes + reader->position, count);
+    reader->position += count;
+  }
+
+  int lineCount = (int)readCount(reader, 8);
+  if (!reader->failed) {
+    chunk->lines = GROW_ARRAY(reader->vm, chunk->lines, LineStart,
+                              0, lineCount);
+    chunk->lineCapacity = lineCount;
+    chunk->lineCount = lineCount;
+    for (int i = 0; i < lineCount; i++) {
+      chunk->lines[i].offset = (int)readU32(reader);
+      chunk->lines[i].line = (int)readU32(reader);
+      // getLine() needs a first run at 0 and runs in order after it
+      int previous = i == 0 ? -1 : chunk->lines[i - 1].offset;
+      if (chunk->lines[i].offset <= previous ||
+          chunk->lines[i].offset >= count ||
+          (i == 0 && chunk->lines[i].offset != 0)) {
+        reader->failed = true;
+        break;
+      }
+    }
+  }
+
+  uint32_t cacheCount = readU32(reader);
+  if (cacheCount > UINT16_MAX + 1) reader->failed = true;
+  if (!reader->failed) {
+    chunk->caches = GROW_ARRAY(reader->vm, chunk->caches, InlineCache,
+                               0, cacheCount);
+    chunk->cacheCapacity = cacheCount;
+    chunk->cacheCount = cacheCount;
+    for (uint32_t i = 0; i < cacheCount; i++) chunk->caches[i].count = 0;
+  }
+
+  // the smallest constant is a tag and a string index
+  int constantCount = (int)readCount(reader, 5);
+  if (constantCount > 0) {
+    // sized once, rather than grown by addConstant()
+    chunk->constants.values =
+        GROW_ARRAY(reader->vm, chunk->constants.values, Value,
+                   0, constantCount);
+    chunk->constants.capacity = constantCount;
+  }
+  for (int i = 0; i < constantCount && !reader->failed; i++) {
+    Value value = NIL_VAL;
+    switch (readU8(reader)) {
+      case CONSTANT_NUMBER: {
+        uint64_t bits = readU64(reader);
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        // a nan with made up payload bits could pass for a boxed object
+        if (isnan(number)) number = NAN;
+        value = NUMBER_VAL(number);
+        break;
+      }
+      case CONSTANT_STRING: {
+        ObjString* string = stringAt(reader, readU32(reader));
+        if (string != NULL) value = OBJ_VAL(string);
+        break;
+      }
+      case CONSTANT_FUNCTION: {
+        ObjFunction* nested = readFunction(reader);
+        if (nested != NULL) value = OBJ_VAL(nested);
+        break;
+      }
+      default:
+        reader->failed = true;
+    }
+    if (reader->failed) break;
+
+    addConstant(reader->vm, chunk, value);
+    WRITE_BARRIER(reader->vm, (Obj*)function, value);
+  }
+
+  if (!reader->failed && (lineCount == 0 || !checkCode(reader, function))) {
+    reader->failed = true;
+  }
+
+  pop(reader->vm);
+  reader->depth--;
+  return reader->failed ? NULL : function;
+}
+
+bool isBytecode(const uint8_t* data, size_t size) {
+  return size >= BYTECODE_HEADER_SIZE && memcmp(data, BYTECODE_MAGIC, 4) == 0;
+}
+
+ObjFunction* readBytecode(VM* vm, const uint8_t* data, size_t size) {
+  if (!isBytecode(data, size) || size - BYTECODE_HEADER_SIZE > INT_MAX) {
+    return NULL;
+  }
+
+  Reader reader;
+  memset(&reader, 0, sizeof(reader));
+  reader.vm = vm;
+  reader.bytes = data;
+  reader.count = size;
+  reader.position = 4;
+
+  uint32_t version = readU32(&reader);
+  uint32_t expected = readU32(&reader);
+  if (version != BYTECODE_VERSION ||
+      expected != checksum(data + BYTECODE_HEADER_SIZE,
+                           size - BYTECODE_HEADER_SIZE)) {
+    return NULL;
+  }
+
+  reader.stringCount = readCount(&reader, 4);
+  reader.stringStarts = malloc(sizeof(uint8_t*) * (reader.stringCount + 1));
+  reader.stringLengths = malloc(sizeof(uint32_t) * (reader.stringCount + 1));
+  reader.interned = calloc(reader.stringCount + 1, sizeof(ObjString*));
+  for (uint32_t i = 0; i < reader.stringCount && !reader.failed; i++) {
+    reader.stringLengths[i] = readCount(&reader, 1);
+    reader.stringStarts[i] = data + reader.position;
+    reader.position += reader.stringLengths[i];
+  }
+
+  reader.globalCount = readCount(&reader, 4);
+  reader.globalSlots = malloc(sizeof(int) * (reader.globalCount + 1));
+  for (uint32_t i = 0; i < reader.globalCount && !reader.failed; i++) {
+    ObjString* name = stringAt(&reader, readU32(&reader));
+    if (name == NULL) break;
+
+    push(vm, OBJ_VAL(name));
+    reader.globalSlots[i] = globalSlot(vm, name);
+    pop(vm);
+  }
+
+  ObjFunction* function = readFunction(&reader);
+  if (reader.position != reader.count) function = NULL;
+
+  free(reader.stringStarts);
+  free(reader.stringLengths);
+  free(reader.interned);
+  free(reader.globalSlots);
+  return function;
+}
+
+ObjFunction* loadBytecode(VM* vm, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat info;
+  if (fstat(fd, &info) < 0 || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  // the file is only read once, straight from the page cache
+  size_t size = (size_t)info.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+
+  ObjFunction* function = readBytecode(vm, data, size);
+  munmap(data, size);
+  return function;
+}
@@ -0,0 +1,28 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// a compiled script, as written by `lox --compile`:
+//   header   "LOXC", u32 version, u32 checksum of everything after the header
+//   strings  u32 count, then the u32 length and characters of each
+//   globals  u32 count, then the string index of the name in each slot
+//   script   the top level function, laid out as in writeFunction()
+// numbers are little endian whatever the host is
+// bump BYTECODE_VERSION whenever the opcodes or this layout change
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 3
+#define BYTECODE_HEADER_SIZE 12
+
+bool isBytecode(const uint8_t* data, size_t size);
+// function must be reachable by the gc, as writing allocates
+bool writeBytecode(VM* vm, ObjFunction* function, FILE* file);
+// NULL unless data is intact bytecode of this version, the function
+// and its strings are allocated in vm
+ObjFunction* readBytecode(VM* vm, const uint8_t* data, size_t size);
+ObjFunction* loadBytecode(VM* vm, const char* path);
+
+#endif
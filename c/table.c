@@ -5,116 +5,242 @@
 #include "object.h"           
 #include "table.h"            
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
+// each slot has a control byte, kept apart from the entries so a probe
+// looks at a whole group of slots with a single 16 byte compare
+// a full slot's byte holds the low 7 bits of its key's hash,
+// the rest of the hash picks the slot a key goes to when that is free,
+// and with it the group the probe starts from
+#define CTRL_EMPTY    ((int8_t)-128)
+#define CTRL_DELETED  ((int8_t)-2)
+#define CTRL_SENTINEL ((int8_t)-1)  // pads tables smaller than a group
+
+#define GROUP_WIDTH 16
+
+#define HASH_TAG(hash)   ((int8_t)((hash) & 0x7f))
+#define HASH_SLOT(hash, capacity) (((hash) >> 7) & ((capacity) - 1))
+
+// bit i is set when slot i of the group matches
+typedef uint32_t GroupMask;
+
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+
+static inline GroupMask matchTag(const int8_t* group, int8_t tag) {
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (GroupMask)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(control, _mm_set1_epi8(tag)));
+}
+
+static inline GroupMask matchFree(const int8_t* group) {
+  // empty and deleted are the only bytes below the sentinel
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (GroupMask)_mm_movemask_epi8(
+      _mm_cmpgt_epi8(_mm_set1_epi8(CTRL_SENTINEL), control));
+}
+#else
+static inline GroupMask matchTag(const int8_t* group, int8_t tag) {
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] == tag) mask |= (GroupMask)1 << i;
+  }
+  return mask;
+}
+
+static inline GroupMask matchFree(const int8_t* group) {
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] < CTRL_SENTINEL) mask |= (GroupMask)1 << i;
+  }
+  return mask;
+}
+#endif
+
+static inline GroupMask matchEmpty(const int8_t* group) {
+  return matchTag(group, CTRL_EMPTY);
+}
+
+static inline int lowestBit(GroupMask mask) {
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+// tables smaller than a group are a single group padded with sentinels
+static inline int groupCount(int capacity) {
+  return capacity < GROUP_WIDTH ? 1 : capacity / GROUP_WIDTH;
+}
+
+static inline size_t controlSize(int capacity) {
+  return capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity;
+}
+
+// entries and control bytes share one allocation
+static inline size_t tableSize(int capacity) {
+  return sizeof(Entry) * capacity + controlSize(capacity);
+}
+
 void initTable(Table* table) {
   table->count = 0;           
   table->capacity = 0;        
   table->entries = NULL;      
+  table->control = NULL;
 }
 
-void freeTable(Table* table) {                       
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {                       
+  if (table->capacity > 0) {
+    reallocate(vm, table->entries, tableSize(table->capacity), 0);
+  }
   initTable(table);                                  
 }
 
-static Entry* findEntry(Entry* entries, int capacity,
-                        ObjString* key) {            
-  uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;              
+// groups are probed in triangular steps, which visits every group
+// once as the group count is a power of two
+// a key is missing once a group on its path has an empty slot
+static int findKey(Table* table, ObjString* key) {
+  if (table->count == 0) return -1;
+
+  // most keys sit in their home slot, and then the control bytes
+  // are not needed: small hot tables like method tables stay as fast
+  // as with plain linear probing
+  uint32_t home = HASH_SLOT(key->hash, table->capacity);
+  if (table->entries[home].key == key) return home;
 
-  for (;;) {                                         
-    Entry* entry = &entries[index];
+  int8_t tag = HASH_TAG(key->hash);
+  uint32_t mask = groupCount(table->capacity) - 1;
+  uint32_t group = home / GROUP_WIDTH;
 
-    if (entry->key == NULL) {                        
-      if (IS_NIL(entry->value)) {                    
-        // Empty entry.                              
-        return tombstone != NULL ? tombstone : entry;
-      } else {                                       
-        // We found a tombstone.                     
-        if (tombstone == NULL) tombstone = entry;    
-      }                                              
-    } else if (entry->key == key) {                  
-      // We found the key.                           
-      return entry;                                  
-    }                                                 
+  for (uint32_t probe = 1;; probe++) {
+    const int8_t* control = table->control + group * GROUP_WIDTH;
+    GroupMask matches = matchTag(control, tag);
+    while (matches != 0) {
+      int index = group * GROUP_WIDTH + lowestBit(matches);
+      if (table->entries[index].key == key) return index;
+      matches &= matches - 1;
+    }
 
-    index = (index + 1) & (capacity - 1);                  
-  }                                                  
+    if (matchEmpty(control) != 0) return -1;
+    group = (group + probe) & mask;
+  }
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {      
-  if (table->count == 0) return false;
+// the first empty or deleted slot on the path of hash
+static int findFree(int8_t* controls, int capacity, uint32_t hash) {
+  uint32_t home = HASH_SLOT(hash, capacity);
+  if (controls[home] < CTRL_SENTINEL) return home;
+
+  uint32_t mask = groupCount(capacity) - 1;
+  uint32_t group = home / GROUP_WIDTH;
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;                          
+  for (uint32_t probe = 1;; probe++) {
+    GroupMask free = matchFree(controls + group * GROUP_WIDTH);
+    if (free != 0) return group * GROUP_WIDTH + lowestBit(free);
+    group = (group + probe) & mask;
+  }
+}
 
-  *value = entry->value;                                         
+bool tableGet(Table* table, ObjString* key, Value* value) {      
+  int index = findKey(table, key);
+  if (index < 0) return false;                          
+
+  *value = table->entries[index].value;                                         
   return true;                                                   
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);           
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+  Entry* entries = (Entry*)reallocate(vm, NULL, 0, tableSize(capacity));
+  int8_t* control = (int8_t*)(entries + capacity);
   for (int i = 0; i < capacity; i++) {                  
     entries[i].key = NULL;                              
     entries[i].value = NIL_VAL;                         
+    control[i] = CTRL_EMPTY;
+  }
+  for (size_t i = capacity; i < controlSize(capacity); i++) {
+    control[i] = CTRL_SENTINEL;
   }
 
-  table->count = 0;
+  // rehashing leaves the deleted slots behind
+  int count = 0;
   for (int i = 0; i < table->capacity; i++) {              
     Entry* entry = &table->entries[i];                     
     if (entry->key == NULL) continue;
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;                                
-    dest->value = entry->value;
-    table->count++;                              
+    int index = findFree(control, capacity, entry->key->hash);
+    control[index] = HASH_TAG(entry->key->hash);
+    entries[index] = *entry;
+    count++;                              
   }
 
   // freeing old table entries reduces vm.bytesAllocated
   // but this is not part of gc, therefore not in gc log
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  freeTable(vm, table);
+  table->count = count;
   table->entries = entries;                             
+  table->control = control;
   table->capacity = capacity;                           
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+  int index = findKey(table, key);
+  if (index >= 0) {
+    table->entries[index].value = value;
+    return false;
+  }
+
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {     
     int capacity = GROW_CAPACITY(table->capacity);               
-    adjustCapacity(table, capacity);                             
+    adjustCapacity(vm, table, capacity);                             
   }
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
+  index = findFree(table->control, table->capacity, key->hash);
+  // count includes deleted slots, so reusing one does not add to it
+  if (table->control[index] == CTRL_EMPTY) table->count++;                                
 
-  bool isNewKey = entry->key == NULL;
-  // increate count when truly empty, not tombstone                            
-  if (isNewKey && IS_NIL(entry->value)) table->count++;                                
-
-  entry->key = key;                                              
-  entry->value = value;                                          
-  return isNewKey;                                               
+  table->control[index] = HASH_TAG(key->hash);
+  table->entries[index].key = key;                                              
+  table->entries[index].value = value;                                          
+  return true;                                               
 }
 
-bool tableDelete(Table* table, ObjString* key) {                 
-  if (table->count == 0) return false;
+static void deleteSlot(Table* table, int index) {
+  // a probe stops at the first group with an empty slot, so when this
+  // group has one no probe passes through it and the slot can be
+  // emptied right away instead of left as a tombstone
+  int8_t* group = table->control + (index & ~(GROUP_WIDTH - 1));
+  if (matchEmpty(group) != 0) {
+    table->control[index] = CTRL_EMPTY;
+    table->count--;
+  } else {
+    table->control[index] = CTRL_DELETED;
+  }
 
-  // Find the entry.                                             
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;                          
+  table->entries[index].key = NULL;                                             
+  table->entries[index].value = NIL_VAL;                                 
+}
 
-  // Place a tombstone in the entry.                             
-  entry->key = NULL;                                             
-  entry->value = BOOL_VAL(true);                                 
+bool tableDelete(VM* vm, Table* table, ObjString* key) {                 
+  int index = findKey(table, key);
+  if (index < 0) return false;                          
 
+  deleteSlot(table, index);
   return true;                                                   
 }
 
-void tableAddAll(Table* from, Table* to) {   
+void tableAddAll(VM* vm, Table* from, Table* to) {   
   for (int i = 0; i < from->capacity; i++) { 
     Entry* entry = &from->entries[i];        
     if (entry->key != NULL) {                
-      tableSet(to, entry->key, entry->value);
+      tableSet(vm, to, entry->key, entry->value);
     }                                        
   }                                          
 }
@@ -126,38 +252,45 @@ ObjString* tableFindString(Table* table, const char* chars, int length,
   // but in chunk.constants, they are still represented as two entries, just pointing to the same sObjString
   if (table->count == 0) return NULL;
 
-  uint32_t index = hash & (table->capacity - 1);                             
+  int8_t tag = HASH_TAG(hash);
+  uint32_t mask = groupCount(table->capacity) - 1;
+  uint32_t group = HASH_SLOT(hash, table->capacity) / GROUP_WIDTH;
 
-  for (;;) {                                                           
-    Entry* entry = &table->entries[index];                             
+  for (uint32_t probe = 1;; probe++) {
+    const int8_t* control = table->control + group * GROUP_WIDTH;
+    GroupMask matches = matchTag(control, tag);
+    while (matches != 0) {
+      ObjString* key = table->entries[group * GROUP_WIDTH +
+                                      lowestBit(matches)].key;
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        // We found it.                                                  
+        return key;                                               
+      }
+      matches &= matches - 1;
+    }
 
-    if (entry->key == NULL) {                                          
-      // Stop if we find an empty non-tombstone entry.                 
-      if (IS_NIL(entry->value)) return NULL;                           
-    } else if (entry->key->length == length &&                         
-        entry->key->hash == hash &&                                    
-        memcmp(entry->key->chars, chars, length) == 0) {               
-      // We found it.                                                  
-      return entry->key;                                               
-    }                                                                  
-
-    index = (index + 1) & (table->capacity - 1);                             
-  }                                                                    
+    // Stop if the group has an empty slot.
+    if (matchEmpty(control) != 0) return NULL;
+    group = (group + probe) & mask;
+  }
 }
 
-void tableRemoveWhite(Table* table) {                     
+void tableRemoveWhite(VM* vm, Table* table) {                     
   for (int i = 0; i < table->capacity; i++) {             
     Entry* entry = &table->entries[i];                    
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);                     
+    // a minor gc never marks old strings, they are all still alive
+    if (entry->key != NULL && !entry->key->obj.isMarked &&
+        !(vm->minorGC && entry->key->obj.isOld)) {
+      deleteSlot(table, i);                     
     }                                                     
   }                                                       
 }
 
-void markTable(Table* table) {               
+void markTable(VM* vm, Table* table) {               
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];       
-    markObject((Obj*)entry->key);            
-    markValue(entry->value);                 
+    markObject(vm, (Obj*)entry->key);            
+    markValue(vm, entry->value);                 
   }                                          
 }
\ No newline at end of file
@@ -10,20 +10,21 @@ typedef struct {
 } Entry; 
 
 typedef struct {    
-  int count;        
+  int count;         // full and deleted slots
   int capacity;     
-  Entry* entries;   
+  Entry* entries;    // empty and deleted slots have a NULL key
+  int8_t* control;   // one byte per slot, right after entries
 } Table; 
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
-bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
+bool tableDelete(VM* vm, Table* table, ObjString* key);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length,
                            uint32_t hash);
-void tableRemoveWhite(Table* table);
-void markTable(Table* table);
+void tableRemoveWhite(VM* vm, Table* table);
+void markTable(VM* vm, Table* table);
 
 #endif  
\ No newline at end of file
@@ -11,11 +11,11 @@ void initValueArray(ValueArray* array) {
   array->count = 0;                     
 } 
 
-void writeValueArray(ValueArray* array, Value value) {       
+void writeValueArray(VM* vm, ValueArray* array, Value value) {       
   if (array->capacity < array->count + 1) {                  
     int oldCapacity = array->capacity;                       
     array->capacity = GROW_CAPACITY(oldCapacity);            
-    array->values = GROW_ARRAY(array->values, Value,         
+    array->values = GROW_ARRAY(vm, array->values, Value,         
                                oldCapacity, array->capacity);
   }
 
@@ -23,32 +23,36 @@ void writeValueArray(ValueArray* array, Value value) {
   array->count++;                                            
 }   
 
-void freeValueArray(ValueArray* array) {            
-  FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {            
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   initValueArray(array);                            
 }  
 
-void printValue(Value value) {
+void fprintValue(FILE* file, Value value) {
 #ifdef NAN_BOXING                             
   if (IS_BOOL(value)) {                       
-    printf(AS_BOOL(value) ? "true" : "false");
+    fprintf(file, AS_BOOL(value) ? "true" : "false");
   } else if (IS_NIL(value)) {                 
-    printf("nil");                            
+    fprintf(file, "nil");                            
   } else if (IS_NUMBER(value)) {              
-    printf("%g", AS_NUMBER(value));           
+    fprintf(file, "%g", AS_NUMBER(value));           
   } else if (IS_OBJ(value)) {                 
-    printObject(value);                       
+    printObject(file, value);                       
   }                                           
 #else 
   switch (value.type) {                                               
-    case VAL_BOOL:   printf(AS_BOOL(value) ? "true" : "false"); break;
-    case VAL_NIL:    printf("nil"); break;                            
-    case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-    case VAL_OBJ:    printObject(value); break;            
+    case VAL_BOOL:   fprintf(file, AS_BOOL(value) ? "true" : "false"); break;
+    case VAL_NIL:    fprintf(file, "nil"); break;                            
+    case VAL_NUMBER: fprintf(file, "%g", AS_NUMBER(value)); break;
+    case VAL_OBJ:    printObject(file, value); break;            
   }
 #endif   
 }
 
+void printValue(Value value) {
+  fprintValue(stdout, value);
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
   if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);                    
@@ -62,5 +66,6 @@ bool valuesEqual(Value a, Value b) {
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
   }
+  return false; // Unreachable.
 #endif                                                      
 }  
\ No newline at end of file
@@ -1,10 +1,14 @@
 #ifndef clox_value_h 
 #define clox_value_h 
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
+// every heap and interpreter state lives in a VM, see vm.h
+typedef struct sVM VM;
 
 #ifdef NAN_BOXING                   
 
@@ -93,8 +97,9 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);              
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);   
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);   
+void fprintValue(FILE* file, Value value);
 void printValue(Value value);    
 
 #endif  
\ No newline at end of file
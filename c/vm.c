@@ -1,54 +1,81 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h> 
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "hash.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"    
 
-VM vm;
-
-static Value clockNative(int argCount, Value* args) {
-  // doesn't check arity 
+static Value clockNative(VM* vm, int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void resetStack() {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+// fibers, see switchFiber()
+static Value fiberNative(VM* vm, int argCount, Value* args);
+static Value resumeNative(VM* vm, int argCount, Value* args);
+static Value yieldNative(VM* vm, int argCount, Value* args);
+static Value isDoneNative(VM* vm, int argCount, Value* args);
+static void endFiber(VM* vm);
+static void switchFiber(VM* vm, ObjFiber* fiber, Value value);
+
+static void* resizeStack(void* stack, size_t size) {
+  void* result = realloc(stack, size);
+  if (result == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  return result;
 }
 
-static void runtimeError(const char* format, ...) {
-  va_list args;                                    
-  va_start(args, format);                          
-  vfprintf(stderr, format, args);                  
-  va_end(args);                                    
-  fputs("\n", stderr);
+static void resetStack(VM* vm) {
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
+}
 
-  for (int i = vm.frameCount - 1; i >= 0; i--) {                 
-    CallFrame* frame = &vm.frames[i];                            
+static void printTrace(VM* vm, CallFrame* frames, int frameCount) {
+  for (int i = frameCount - 1; i >= 0; i--) {                 
+    CallFrame* frame = &frames[i];                            
     ObjFunction* function = frame->closure->function;                     
     // -1 because the IP is sitting on the next instruction to be
     // executed.                                                 
     size_t instruction = frame->ip - function->chunk.code - 1;   
-    fprintf(stderr, "[line %d] in ",                             
-            function->chunk.lines[instruction]);                 
+    fprintf(vm->errors, "[line %d] in ",                             
+            getLine(&function->chunk, (int)instruction));                 
     if (function->name == NULL) {                                
-      fprintf(stderr, "script\n");                               
+      fprintf(vm->errors, "script\n");                               
     } else {                                                     
-      fprintf(stderr, "%s()\n", function->name->chars);          
+      fprintf(vm->errors, "%s()\n", function->name->chars);          
     }                                                            
   }
+}
+
+static void runtimeError(VM* vm, const char* format, ...) {
+  va_list args;                                    
+  va_start(args, format);                          
+  vfprintf(vm->errors, format, args);                  
+  va_end(args);                                    
+  fputs("\n", vm->errors);
 
-  resetStack();                                    
+  // down through the fibers that wait for the running one
+  printTrace(vm, vm->frames, vm->frameCount);
+  for (ObjFiber* fiber = vm->fiber->caller; fiber != NULL;
+       fiber = fiber->caller) {
+    printTrace(vm, fiber->frames, fiber->frameCount);
+  }
+
+  // and all of them are done, the main fiber starts over
+  while (vm->fiber != vm->mainFiber) endFiber(vm);
+  resetStack(vm);                                    
 }
 
-static void defineNative(const char* name, NativeFn function) {
+void defineNative(VM* vm, const char* name, int arity, NativeFn function) {
   // push then pop for gc
   // the c-string name itself is a string literal, which should always exists, and as it's not an obj, it will not go through gc
   // but after using copyString, an objstring will be created, which wraps a copy of the c-string literal
@@ -56,110 +83,260 @@ static void defineNative(const char* name, NativeFn function) {
   // so it can be removed by gc when immediately newNative and tableGet try to allocate memory
   // to ensure it not get removed, we push it onto the stack, so that it get marked via stack
   // the same trick apply to the newly created ObjNative via newNative, which can be removed via tableGet, if not pushed onto the stack
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));                          
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);  
-  pop();                                                       
-  pop();
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function, arity)));
+  int slot = globalSlot(vm, AS_STRING(vm->stackTop[-2]));
+  vm->globalValues.values[slot] = vm->stackTop[-1];
+  tableSet(vm, &vm->natives, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+  pop(vm);                                                       
+  pop(vm);
 
   // for lox function, we need to
   // define fnName as constant, define fn as constant
   // push fn to stack, then run [OP_DEFINE_GLOBAL, fnName] for tableSet and pop fn
-  // for native function, it's defined before compile, so just tableSet                                                 
+  // for native function, it's defined before compile, so just store it in its slot
 }
 
-void initVM() { 
-  resetStack();
-  vm.objects = NULL;
+int globalSlot(VM* vm, ObjString* name) {
+  // name must be reachable by the gc, as a new slot allocates
+  Value slot;
+  if (tableGet(&vm->globalNames, name, &slot)) return (int)AS_NUMBER(slot);
 
-  vm.bytesAllocated = 0;  
-  vm.nextGC = 1024 * 1024;
+  writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+  tableSet(vm, &vm->globalNames, name, NUMBER_VAL(vm->globalValues.count - 1));
+  return vm->globalValues.count - 1;
+}
 
-  vm.grayCount = 0;      
-  vm.grayCapacity = 0;   
-  vm.grayStack = NULL;
+ObjString* globalName(VM* vm, int slot) {
+  // only needed for error messages, so a scan is fine
+  for (int i = 0; i < vm->globalNames.capacity; i++) {
+    Entry* entry = &vm->globalNames.entries[i];
+    if (entry->key != NULL && AS_NUMBER(entry->value) == slot) {
+      return entry->key;
+    }
+  }
+  return NULL;
+}
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+static void shareProgram(VM* vm, Program* program) {
+  // strings are equal when they are the same object, so a string made
+  // at run time has to be the frozen one whenever that has its chars
+  for (int i = 0; i < program->stringCount; i++) {
+    tableSet(vm, &vm->strings, program->strings[i], NIL_VAL);
+  }
+  for (int i = 0; i < program->globalCount; i++) {
+    globalSlot(vm, program->globals[i]);
+  }
 
-  vm.initString = NULL;
-  vm.initString = copyString("init", 4);
+  vm->sharedCaches = ALLOCATE(vm, InlineCache, program->cacheCount);
+  for (int i = 0; i < program->cacheCount; i++) {
+    vm->sharedCaches[i].count = 0;
+  }
+  vm->sharedCacheCount = program->cacheCount;
+}
+
+void initVM(VM* vm) {
+  initSharedVM(vm, NULL);
+}
 
-  defineNative("clock", clockNative);  
+void initSharedVM(VM* vm, Program* program) {
+  // like vm.grayStack the stacks are not counted as gc heap
+  vm->frameCapacity = FRAMES_INITIAL;
+  vm->frames = resizeStack(NULL, sizeof(CallFrame) * vm->frameCapacity);
+  vm->stackCapacity = STACK_INITIAL;
+  vm->stack = resizeStack(NULL, sizeof(Value) * vm->stackCapacity);
+  resetStack(vm);
+  vm->parser = NULL;
+  vm->objects = NULL;
+  vm->fiber = NULL;
+  vm->mainFiber = NULL;
+  vm->nextFiber = NULL;
+  vm->initString = NULL;
+
+  for (int i = 0; i < POOL_CLASSES; i++) vm->freeBlocks[i] = NULL;
+  vm->pages = NULL;
+
+  vm->bytesAllocated = 0;  
+  vm->nextGC = 1024 * 1024;
+  vm->nurseryBytes = 0;
+  vm->minorGC = false;
+
+  vm->grayCount = 0;      
+  vm->grayCapacity = 0;   
+  vm->grayStack = NULL;
+
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->remembered = NULL;
+
+  vm->gcPhase = GC_IDLE;
+  vm->sweepList = NULL;
+  vm->sweepLink = NULL;
+#ifdef DEBUG_GC_STATS
+  vm->gcPauses = 0;
+  vm->gcMaxPause = 0;
+#endif
+
+  initTable(&vm->globalNames);
+  initValueArray(&vm->globalValues);
+  initTable(&vm->strings);
+  initTable(&vm->scripts);
+  initTable(&vm->natives);
+  vm->sharedCaches = NULL;
+  vm->sharedCacheCount = 0;
+  if (program != NULL) shareProgram(vm, program);
+  vm->output = stdout;
+  vm->errors = stderr;
+
+  // the stacks allocated above are those of the main fiber
+  vm->mainFiber = newFiber(vm, NULL);
+  vm->mainFiber->state = FIBER_RUNNING;
+  vm->fiber = vm->mainFiber;
+
+  vm->initString = copyString(vm, "init", 4);
+
+  defineNative(vm, "clock", 0, clockNative);
+  defineNative(vm, "Fiber", 1, fiberNative);
+  defineNative(vm, "resume", -1, resumeNative);
+  defineNative(vm, "yield", -1, yieldNative);
+  defineNative(vm, "isDone", 1, isDoneNative);
 }                  
 
-void freeVM() {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
-  vm.initString = NULL;
-  freeObjects();    
+void freeVM(VM* vm) {
+#ifdef DEBUG_GC_STATS
+  fprintf(stderr, "gc: %d pauses, longest %.3f ms\n",
+          vm->gcPauses, vm->gcMaxPause * 1000);
+#endif
+  freeTable(vm, &vm->globalNames);
+  freeValueArray(vm, &vm->globalValues);
+  freeTable(vm, &vm->strings);
+  freeTable(vm, &vm->scripts);
+  freeTable(vm, &vm->natives);
+  FREE_ARRAY(vm, InlineCache, vm->sharedCaches, vm->sharedCacheCount);
+  vm->sharedCacheCount = 0;
+  vm->initString = NULL;
+  freeObjects(vm);    
+  free(vm->frames);
+  free(vm->stack);
+  vm->frames = NULL;
+  vm->stack = NULL;
+}
+
+void push(VM* vm, Value value) {
+  *vm->stackTop = value; 
+  vm->stackTop++;        
 }
 
-void push(Value value) {
-  *vm.stackTop = value; 
-  vm.stackTop++;        
+Value pop(VM* vm) {         
+  vm->stackTop--;      
+  return *vm->stackTop;
 }
 
-Value pop() {         
-  vm.stackTop--;      
-  return *vm.stackTop;
+static Value peek(VM* vm, int distance) {   
+  return vm->stackTop[-1 - distance];
 }
 
-static Value peek(int distance) {   
-  return vm.stackTop[-1 - distance];
+static void growFrames(VM* vm) {
+  vm->frameCapacity *= 2;
+  if (vm->frameCapacity > FRAMES_MAX) vm->frameCapacity = FRAMES_MAX;
+  vm->frames = resizeStack(vm->frames, sizeof(CallFrame) * vm->frameCapacity);
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+static void growStack(VM* vm, int needed) {
+  int capacity = vm->stackCapacity;
+  while (capacity < needed) capacity *= 2;
+  Value* stack = resizeStack(NULL, sizeof(Value) * capacity);
+  memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+
+  // everything that points into the stack follows it to the new block
+  // run() reloads its cached slots and stackTop after every call
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm->stack);
+  }
+  vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+  free(vm->stack);
+  vm->stack = stack;
+  vm->stackCapacity = capacity;
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {                   
-    runtimeError("Expected %d arguments but got %d.",  
+    runtimeError(vm, "Expected %d arguments but got %d.",  
         closure->function->arity, argCount);                    
     return false;                                      
   }
 
-  if (vm.frameCount == FRAMES_MAX) {             
-    runtimeError("Stack overflow.");             
-    return false;                                
+  if (vm->frameCount == vm->frameCapacity) {
+    if (vm->frameCapacity == FRAMES_MAX) {
+      runtimeError(vm, "Stack overflow.");             
+      return false;                                
+    }
+    growFrames(vm);
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];      
+  // only growing here keeps pushes in run() free of bounds checks
+  int needed = (int)(vm->stackTop - vm->stack) - argCount - 1 +
+               closure->function->maxSlots;
+  if (needed > vm->stackCapacity) growStack(vm, needed);
+
+  CallFrame* frame = &vm->frames[vm->frameCount++];      
   frame->closure = closure;                          
   frame->ip = closure->function->chunk.code;
 
-  frame->slots = vm.stackTop - argCount - 1;           
+  frame->slots = vm->stackTop - argCount - 1;           
   return true;                                         
 }
 
-static bool callValue(Value callee, int argCount) {    
+static bool callValue(VM* vm, Value callee, int argCount) {    
   if (IS_OBJ(callee)) {                                
     switch (OBJ_TYPE(callee)) {
       case OBJ_BOUND_METHOD: {                          
         ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
         // reuse closure slot to store this instance
-        vm.stackTop[-argCount - 1] = bound->receiver;
-        return call(bound->method, argCount);           
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);           
       }
       case OBJ_CLASS: {
         ObjClass* klass = AS_CLASS(callee);
         // change klass to instance
-        vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
         Value initializer;                                           
-        if (tableGet(&klass->methods, vm.initString, &initializer)) {
-          return call(AS_CLOSURE(initializer), argCount);            
+        if (tableGet(&klass->methods, vm->initString, &initializer)) {
+          return call(vm, AS_CLOSURE(initializer), argCount);            
         } else if (argCount != 0) {                                  
-          runtimeError("Expected 0 arguments but got %d.", argCount);
+          runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
           return false;                                              
         }
         return true;                                             
       }
       case OBJ_CLOSURE:                           
-        return call(AS_CLOSURE(callee), argCount);                        
+        return call(vm, AS_CLOSURE(callee), argCount);                        
       // case OBJ_FUNCTION: 
       //   return call(AS_FUNCTION(callee), argCount);
       case OBJ_NATIVE: {                                        
-        NativeFn native = AS_NATIVE(callee);                    
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;                            
-        push(result);                                           
+        ObjNative* native = (ObjNative*)AS_OBJ(callee);
+        if (native->arity >= 0 && argCount != native->arity) {
+          runtimeError(vm, "Expected %d arguments but got %d.",
+                       native->arity, argCount);
+          return false;
+        }
+        Value result = native->function(vm, argCount, vm->stackTop - argCount);
+        // a native that fails has reported a runtime error already
+        if (IS_UNDEFINED(result)) return false;
+        vm->stackTop -= argCount + 1;                            
+        if (vm->nextFiber != NULL) {
+          // resume() and yield() hand their result to another fiber
+          ObjFiber* fiber = vm->nextFiber;
+          vm->nextFiber = NULL;
+          switchFiber(vm, fiber, result);
+          return true;
+        }
+        push(vm, result);                                           
         return true;                                            
       }
       default:                                         
@@ -168,55 +345,154 @@ static bool callValue(Value callee, int argCount) {
     }                                                  
   }                                                    
 
-  runtimeError("Can only call functions and classes.");
+  runtimeError(vm, "Can only call functions and classes.");
   return false;                                        
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name,
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name,
                             int argCount) {                  
   Value method;                                              
   if (!tableGet(&klass->methods, name, &method)) {           
-    runtimeError("Undefined property '%s'.", name->chars);   
+    runtimeError(vm, "Undefined property '%s'.", name->chars);   
     return false;                                            
   }
 
   // this = receiver is already on the start of the substack
-  return call(AS_CLOSURE(method), argCount);                 
+  return call(vm, AS_CLOSURE(method), argCount);                 
+}
+
+static CacheEntry* findCacheEntry(InlineCache* cache, ObjShape* shape) {
+  // a site always looks up the same name, so the shape alone decides
+  // where the field is or that it is absent and the method applies
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
+  }
+
+  return NULL;
+}
+
+static void addCacheEntry(VM* vm, InlineCache* cache, ObjShape* shape,
+                          ObjShape* transition, int slot, Value method) {
+  // instances in dictionary mode have no shape to guard on
+  if (shape == NULL) return;
+  // once all ways are taken the site is megamorphic and stays uncached
+  if (cache->count == INLINE_CACHE_WAYS) return;
+
+  CacheEntry* entry = &cache->entries[cache->count++];
+  entry->shape = shape;
+  entry->transition = transition;
+  entry->slot = slot;
+  entry->method = method;
+
+  // the cache belongs to the function running in the top frame, unless
+  // it is frozen and the cache one of vm.sharedCaches, which are roots
+  ObjFunction* function = vm->frames[vm->frameCount - 1].closure->function;
+  if (function->sharedCaches < 0) rememberObject(vm, (Obj*)function);
 }
 
-static bool invoke(ObjString* name, int argCount) {       
-  Value receiver = peek(argCount);
+static bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {       
+  Value receiver = peek(vm, argCount);
   if (!IS_INSTANCE(receiver)) {                  
-    runtimeError("Only instances have methods.");
+    runtimeError(vm, "Only instances have methods.");
     return false;                                
   }
   ObjInstance* instance = AS_INSTANCE(receiver);
+
+  CacheEntry* cached = findCacheEntry(cache, instance->shape);
+  if (cached != NULL) {
+    if (cached->slot < 0) return call(vm, AS_CLOSURE(cached->method), argCount);
+
+    Value value = instance->slots[cached->slot];
+    vm->stackTop[-argCount - 1] = value;
+    return callValue(vm, value, argCount);
+  }
   
-  Value value;                                            
-  if (tableGet(&instance->fields, name, &value)) {        
-    vm.stackTop[-argCount - 1] = value; // do not think this is necessary, but it aligns with OP_GET_PROPERTY                  
-    return callValue(value, argCount);                    
+  Value value;
+  if (getField(instance, name, &value)) {        
+    if (instance->shape != NULL) {
+      addCacheEntry(vm, cache, instance->shape, NULL,
+                    shapeSlot(instance->shape, name), NIL_VAL);
+    }
+    vm->stackTop[-argCount - 1] = value; // do not think this is necessary, but it aligns with OP_GET_PROPERTY                  
+    return callValue(vm, value, argCount);                    
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  Value method;
+  if (!tableGet(&instance->klass->methods, name, &method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  addCacheEntry(vm, cache, instance->shape, NULL, -1, method);
+  return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {            
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {            
   Value method;                                                       
   if (!tableGet(&klass->methods, name, &method)) {                    
-    runtimeError("Undefined property '%s'.", name->chars);            
+    runtimeError(vm, "Undefined property '%s'.", name->chars);            
     return false;                                                     
   }
 
-  ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-  pop();                                                              
-  push(OBJ_VAL(bound));                                               
+  ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+  pop(vm);                                                              
+  push(vm, OBJ_VAL(bound));                                               
   return true;                                                        
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+static bool getProperty(VM* vm, ObjString* name, InlineCache* cache) {
+  // slow path of OP_GET_PROPERTY, the instance is on top of the stack
+  ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+
+  CacheEntry* cached = findCacheEntry(cache, instance->shape);
+  if (cached != NULL) {
+    if (cached->slot >= 0) {
+      vm->stackTop[-1] = instance->slots[cached->slot];
+    } else {
+      ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0),
+                                             AS_CLOSURE(cached->method));
+      vm->stackTop[-1] = OBJ_VAL(bound);
+    }
+    return true;
+  }
+
+  Value value;
+  if (getField(instance, name, &value)) {
+    if (instance->shape != NULL) {
+      addCacheEntry(vm, cache, instance->shape, NULL,
+                    shapeSlot(instance->shape, name), NIL_VAL);
+    }
+    vm->stackTop[-1] = value;
+    return true;
+  }
+
+  Value method;
+  if (tableGet(&instance->klass->methods, name, &method)) {
+    addCacheEntry(vm, cache, instance->shape, NULL, -1, method);
+  }
+  return bindMethod(vm, instance->klass, name);
+}
+
+static void setProperty(VM* vm, ObjString* name, InlineCache* cache) {
+  // slow path of OP_SET_PROPERTY, the instance is below the value
+  ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+  ObjShape* shape = instance->shape;
+  bool known = findCacheEntry(cache, shape) != NULL;
+
+  setField(vm, instance, name, peek(vm, 0));
+  if (known || instance->shape == NULL) return;
+
+  if (instance->shape == shape) {
+    addCacheEntry(vm, cache, shape, NULL, shapeSlot(shape, name), NIL_VAL);
+  } else {
+    // the field was added, so remember the transition as well
+    addCacheEntry(vm, cache, shape, instance->shape, shape->slotCount, NIL_VAL);
+  }
+}
+
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
   ObjUpvalue* prevUpvalue = NULL;                                   
-  ObjUpvalue* upvalue = vm.openUpvalues;
+  ObjUpvalue* upvalue = vm->openUpvalues;
 
   while (upvalue != NULL && upvalue->location > local) {            
     prevUpvalue = upvalue;                                          
@@ -226,7 +502,7 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   // reuse existing upvalue
   if (upvalue != NULL && upvalue->location == local) return upvalue;
 
-  ObjUpvalue* createdUpvalue = newUpvalue(local);
+  ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
   createdUpvalue->next = upvalue;
 
   // captureUpvalue is called when inner function closure get defined
@@ -234,7 +510,7 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   // captured upvalues will be open and appended to vm.openUpvalues
   // then when outer function returned, they will be closed via closeUpValues
   if (prevUpvalue == NULL) {                     
-    vm.openUpvalues = createdUpvalue;            
+    vm->openUpvalues = createdUpvalue;            
   } else {                                       
     prevUpvalue->next = createdUpvalue;          
   }
@@ -242,276 +518,674 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   return createdUpvalue;                         
 }
 
-static void closeUpvalues(Value* last) {
+static void closeUpvalues(VM* vm, Value* last) {
   // this moves upvalues from stack to heap  
-  while (vm.openUpvalues != NULL &&          
-         vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;   
+  while (vm->openUpvalues != NULL &&          
+         vm->openUpvalues->location >= last) {
+    ObjUpvalue* upvalue = vm->openUpvalues;   
     upvalue->closed = *upvalue->location;    
     upvalue->location = &upvalue->closed;    
-    vm.openUpvalues = upvalue->next;         
+    WRITE_BARRIER(vm, (Obj*)upvalue, upvalue->closed);
+    vm->openUpvalues = upvalue->next;         
   }                                          
 }
 
-static void defineMethod(ObjString* name) {
-  Value method = peek(0);                  
-  ObjClass* klass = AS_CLASS(peek(1));     
-  tableSet(&klass->methods, name, method); 
-  pop();                                   
+// the running fiber has its stacks in the vm, where run() and the gc
+// find them without asking which fiber it is
+static void loadStacks(VM* vm, ObjFiber* fiber) {
+  vm->frames = fiber->frames;
+  vm->frameCount = fiber->frameCount;
+  vm->frameCapacity = fiber->frameCapacity;
+  vm->stack = fiber->stack;
+  vm->stackTop = fiber->stackTop;
+  vm->stackCapacity = fiber->stackCapacity;
+  vm->openUpvalues = fiber->openUpvalues;
+  vm->fiber = fiber;
+
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->stack = NULL;
+  fiber->stackTop = NULL;
+  fiber->openUpvalues = NULL;
+}
+
+static void saveStacks(VM* vm, ObjFiber* fiber) {
+  fiber->frames = vm->frames;
+  fiber->frameCount = vm->frameCount;
+  fiber->frameCapacity = vm->frameCapacity;
+  fiber->stack = vm->stack;
+  fiber->stackTop = vm->stackTop;
+  fiber->stackCapacity = vm->stackCapacity;
+  fiber->openUpvalues = vm->openUpvalues;
+  // the stacks were roots and were written without barriers, now they
+  // are the fiber's, so a gc that has looked at it looks again
+  rememberObject(vm, (Obj*)fiber);
+}
+
+// the running fiber is done and the one that resumed it goes on
+static void endFiber(VM* vm) {
+  ObjFiber* fiber = vm->fiber;
+  // once its upvalues are closed nothing points into the stacks
+  closeUpvalues(vm, vm->stack);
+  free(vm->frames);
+  free(vm->stack);
+  fiber->state = FIBER_DONE;
+  fiber->closure = NULL;
+  loadStacks(vm, fiber->caller);
+  fiber->caller = NULL;
+}
+
+// resume() and yield() have set the state of the running fiber, this
+// moves its stacks out of the vm and those of fiber in, with value as
+// the result of the call that switched to it
+static void switchFiber(VM* vm, ObjFiber* fiber, Value value) {
+  saveStacks(vm, vm->fiber);
+  if (fiber->state != FIBER_NEW) {
+    loadStacks(vm, fiber);
+    push(vm, value);
+    fiber->state = FIBER_RUNNING;
+    return;
+  }
+
+  // the first call fits without growing, a fiber that only yields
+  // from its function takes little more than that
+  ObjClosure* closure = fiber->closure;
+  int arity = closure->function->arity;
+  fiber->frameCapacity = FIBER_FRAMES_INITIAL;
+  fiber->frames = resizeStack(NULL, sizeof(CallFrame) * fiber->frameCapacity);
+  fiber->stackCapacity = closure->function->maxSlots;
+  fiber->stack = resizeStack(NULL, sizeof(Value) * fiber->stackCapacity);
+  fiber->stackTop = fiber->stack;
+  loadStacks(vm, fiber);
+  fiber->state = FIBER_RUNNING;
+
+  // the value of the first resume() is the argument, if it takes one
+  push(vm, OBJ_VAL(closure));
+  if (arity == 1) push(vm, value);
+  call(vm, closure, arity);
+}
+
+static Value fiberNative(VM* vm, int argCount, Value* args) {
+  if (!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+    runtimeError(vm, "A fiber runs a function of at most one parameter.");
+    return UNDEFINED_VAL;
+  }
+  return OBJ_VAL(newFiber(vm, AS_CLOSURE(args[0])));
+}
+
+static Value resumeNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 && argCount != 2) {
+    runtimeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+    return UNDEFINED_VAL;
+  }
+  if (!IS_FIBER(args[0])) {
+    runtimeError(vm, "Can only resume fibers.");
+    return UNDEFINED_VAL;
+  }
+
+  ObjFiber* fiber = AS_FIBER(args[0]);
+  if (fiber->state == FIBER_DONE) {
+    runtimeError(vm, "Cannot resume a finished fiber.");
+    return UNDEFINED_VAL;
+  }
+  if (fiber->state == FIBER_RUNNING) {
+    runtimeError(vm, "Cannot resume a running fiber.");
+    return UNDEFINED_VAL;
+  }
+  // from callFunction() the yield back would find no frame to go on in
+  if (vm->frameCount == 0) {
+    runtimeError(vm, "Can only resume a fiber from a lox function.");
+    return UNDEFINED_VAL;
+  }
+
+  fiber->caller = vm->fiber;
+  vm->nextFiber = fiber;
+  return argCount == 2 ? args[1] : NIL_VAL;
+}
+
+static Value yieldNative(VM* vm, int argCount, Value* args) {
+  if (argCount > 1) {
+    runtimeError(vm, "Expected 0 or 1 arguments but got %d.", argCount);
+    return UNDEFINED_VAL;
+  }
+
+  ObjFiber* fiber = vm->fiber;
+  if (fiber->caller == NULL) {
+    runtimeError(vm, "Cannot yield from the main fiber.");
+    return UNDEFINED_VAL;
+  }
+
+  fiber->state = FIBER_SUSPENDED;
+  vm->nextFiber = fiber->caller;
+  fiber->caller = NULL;
+  return argCount == 1 ? args[0] : NIL_VAL;
+}
+
+static Value isDoneNative(VM* vm, int argCount, Value* args) {
+  if (!IS_FIBER(args[0])) {
+    runtimeError(vm, "Can only ask a fiber whether it is done.");
+    return UNDEFINED_VAL;
+  }
+  return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+static void defineMethod(VM* vm, ObjString* name) {
+  Value method = peek(vm, 0);                  
+  ObjClass* klass = AS_CLASS(peek(vm, 1));     
+  tableSet(vm, &klass->methods, name, method); 
+  rememberObject(vm, (Obj*)klass);
+  pop(vm);                                   
 }
 
 static bool isFalsey(Value value) {                           
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {                      
-  ObjString* b = AS_STRING(peek(0)); 
-  ObjString* a = AS_STRING(peek(1));
+static Obj* textPiece(Value value) {
+  // a rope that has been flattened is as good as its string
+  if (IS_ROPE(value) && AS_ROPE(value)->flat != NULL) {
+    return (Obj*)AS_ROPE(value)->flat;
+  }
+  return AS_OBJ(value);
+}
 
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);            
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';                          
+static int textLength(Obj* piece) {
+  if (piece->type == OBJ_ROPE) return ((ObjRope*)piece)->length;
+  return ((ObjString*)piece)->length;
+}
 
-  ObjString* result = takeString(chars, length);
-  pop();                                        
-  pop(); 
-  push(OBJ_VAL(result));                         
+static void concatenate(VM* vm) {                      
+  Obj* b = textPiece(peek(vm, 0)); 
+  Obj* a = textPiece(peek(vm, 1));
+  int length = textLength(a) + textLength(b);
+
+  Value result;
+  if (length >= ROPE_MIN_LENGTH) {
+    // long strings are copied once, when first needed,
+    // so building one piece by piece stays linear
+    result = OBJ_VAL(newRope(vm, a, b, length));
+  } else {
+    // ropes are never this short, so both pieces are flat strings
+    ObjString* x = (ObjString*)a;
+    ObjString* y = (ObjString*)b;
+
+    // one allocation holds both the header and the characters
+    ObjString* string = allocateString(vm, length);
+    memcpy(string->chars, x->chars, x->length);            
+    memcpy(string->chars + x->length, y->chars, y->length);
+    result = OBJ_VAL(takeString(vm, string));
+  }
+
+  pop(vm);                                        
+  pop(vm); 
+  push(vm, result);                         
 }
 
-static InterpretResult run() {
+static void flattenOperand(VM* vm, int distance) {
+  // strings are compared and printed by their interned objString
+  Value value = peek(vm, distance);
+  if (IS_ROPE(value)) {
+    vm->stackTop[-1 - distance] = OBJ_VAL(flattenRope(vm, AS_ROPE(value)));
+  }
+}
+
+static InterpretResult run(VM* vm) {
 #ifdef DEBUG_TRACE_EXECUTION
   printf("== <execute script> ==\n");
 #endif 
 
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  // the hot interpreter state is cached in locals so the compiler can keep it in registers
+  // frame->ip and vm.stackTop are only written back by STORE_FRAME() before anything
+  // that may look at them: calls, allocations (which can trigger gc) and runtime errors
+  // LOAD_FRAME() picks the state up again afterwards, possibly from a different frame
+  CallFrame* frame;
+  register uint8_t* ip;
+  register Value* slots;
+  register Value* stackTop;
+  // the index operand of an instruction with a _LONG form, read by
+  // either form before both continue in the same handler
+  uint32_t index;
+
+#define STORE_FRAME() (frame->ip = ip, vm->stackTop = stackTop)
+#define LOAD_FRAME() \
+    (frame = &vm->frames[vm->frameCount - 1], \
+     ip = frame->ip, \
+     slots = frame->slots, \
+     stackTop = vm->stackTop)
 
-#define READ_BYTE() (*frame->ip++)
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define DROP() (stackTop--)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define CONSTANT(index) \
+    (frame->closure->function->chunk.constants.values[index])
+#define READ_CONSTANT() CONSTANT(READ_BYTE())
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->caches[READ_SHORT()])
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(vm, __VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
 #define BINARY_OP(valueType, op) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
       \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      PUSH(valueType(a op b)); \
     } while (false)           
 
-  for (;;) {
+// a fused comparison pops both operands and jumps when the result is false
+#define COMPARE_JUMP(op) \
+    do { \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      uint16_t offset = READ_SHORT(); \
+      if (!(a op b)) ip += offset; \
+    } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");                                           
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {      
-      printf("[ ");                                                 
-      printValue(*slot);                                            
-      printf(" ]");                                                 
-    }                                                               
-    printf("\n");                                      
-    disassembleInstruction(&frame->closure->function->chunk,     
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() \
+    do { \
+      printf("          "); \
+      for (Value* slot = vm->stack; slot < stackTop; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleInstruction(vm, &frame->closure->function->chunk, \
+          (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
 #endif
 
-    uint8_t instruction;                
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {                
+  LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+  // threaded dispatch: every handler jumps straight to the next one
+  // so each opcode gets its own indirect branch for the predictor to learn
+  static void* dispatchTable[] = {
+    [OP_CONSTANT] = &&do_OP_CONSTANT,
+    [OP_NIL] = &&do_OP_NIL,
+    [OP_TRUE] = &&do_OP_TRUE,
+    [OP_FALSE] = &&do_OP_FALSE,
+    [OP_POP] = &&do_OP_POP,
+    [OP_GET_LOCAL] = &&do_OP_GET_LOCAL,
+    [OP_SET_LOCAL] = &&do_OP_SET_LOCAL,
+    [OP_GET_GLOBAL] = &&do_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL] = &&do_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL] = &&do_OP_SET_GLOBAL,
+    [OP_GET_UPVALUE] = &&do_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE] = &&do_OP_SET_UPVALUE,
+    [OP_GET_PROPERTY] = &&do_OP_GET_PROPERTY,
+    [OP_SET_PROPERTY] = &&do_OP_SET_PROPERTY,
+    [OP_GET_SUPER] = &&do_OP_GET_SUPER,
+    [OP_EQUAL] = &&do_OP_EQUAL,
+    [OP_GREATER] = &&do_OP_GREATER,
+    [OP_LESS] = &&do_OP_LESS,
+    [OP_ADD] = &&do_OP_ADD,
+    [OP_SUBTRACT] = &&do_OP_SUBTRACT,
+    [OP_MULTIPLY] = &&do_OP_MULTIPLY,
+    [OP_DIVIDE] = &&do_OP_DIVIDE,
+    [OP_NOT] = &&do_OP_NOT,
+    [OP_NEGATE] = &&do_OP_NEGATE,
+    [OP_PRINT] = &&do_OP_PRINT,
+    [OP_JUMP] = &&do_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&do_OP_JUMP_IF_FALSE,
+    [OP_LOOP] = &&do_OP_LOOP,
+    [OP_CALL] = &&do_OP_CALL,
+    [OP_INVOKE] = &&do_OP_INVOKE,
+    [OP_SUPER_INVOKE] = &&do_OP_SUPER_INVOKE,
+    [OP_CLOSURE] = &&do_OP_CLOSURE,
+    [OP_CLOSE_UPVALUE] = &&do_OP_CLOSE_UPVALUE,
+    [OP_RETURN] = &&do_OP_RETURN,
+    [OP_CLASS] = &&do_OP_CLASS,
+    [OP_INHERIT] = &&do_OP_INHERIT,
+    [OP_METHOD] = &&do_OP_METHOD,
+    [OP_CONSTANT_LONG] = &&do_OP_CONSTANT_LONG,
+    [OP_GET_LOCAL_LONG] = &&do_OP_GET_LOCAL_LONG,
+    [OP_SET_LOCAL_LONG] = &&do_OP_SET_LOCAL_LONG,
+    [OP_GET_GLOBAL_LONG] = &&do_OP_GET_GLOBAL_LONG,
+    [OP_DEFINE_GLOBAL_LONG] = &&do_OP_DEFINE_GLOBAL_LONG,
+    [OP_SET_GLOBAL_LONG] = &&do_OP_SET_GLOBAL_LONG,
+    [OP_GET_PROPERTY_LONG] = &&do_OP_GET_PROPERTY_LONG,
+    [OP_SET_PROPERTY_LONG] = &&do_OP_SET_PROPERTY_LONG,
+    [OP_GET_SUPER_LONG] = &&do_OP_GET_SUPER_LONG,
+    [OP_INVOKE_LONG] = &&do_OP_INVOKE_LONG,
+    [OP_SUPER_INVOKE_LONG] = &&do_OP_SUPER_INVOKE_LONG,
+    [OP_CLOSURE_LONG] = &&do_OP_CLOSURE_LONG,
+    [OP_CLASS_LONG] = &&do_OP_CLASS_LONG,
+    [OP_METHOD_LONG] = &&do_OP_METHOD_LONG,
+    [OP_ADD_CONST] = &&do_OP_ADD_CONST,
+    [OP_ADD_LOCAL_CONST] = &&do_OP_ADD_LOCAL_CONST,
+    [OP_LESS_JUMP_IF_FALSE] = &&do_OP_LESS_JUMP_IF_FALSE,
+    [OP_GREATER_JUMP_IF_FALSE] = &&do_OP_GREATER_JUMP_IF_FALSE,
+    [OP_GET_LOCAL_GET_PROPERTY] = &&do_OP_GET_LOCAL_GET_PROPERTY
+  };
+
+#define CASE(op) do_##op
+#define DISPATCH() \
+    do { \
+      TRACE_EXECUTION(); \
+      goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+
+  DISPATCH();
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+
+  for (;;) {
+    TRACE_EXECUTION();
+
+    switch (READ_BYTE()) {
+#endif
+      CASE(OP_CONSTANT): {                
         Value constant = READ_CONSTANT();
-        push(constant);                  
-        break;                           
+        PUSH(constant);                  
+        DISPATCH();                           
       }
-      case OP_NIL: push(NIL_VAL); break;                
-      case OP_TRUE: push(BOOL_VAL(true)); break;        
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP: pop(); break;
-      case OP_GET_LOCAL: {             
+      CASE(OP_CONSTANT_LONG): PUSH(CONSTANT(READ_LONG())); DISPATCH();
+      CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();                
+      CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();        
+      CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+      CASE(OP_POP): DROP(); DISPATCH();
+      CASE(OP_GET_LOCAL): {             
         uint8_t slot = READ_BYTE();    
-        push(frame->slots[slot]);
-        break;                         
+        PUSH(slots[slot]);
+        DISPATCH();                         
       }
-      case OP_SET_LOCAL: {         
+      CASE(OP_SET_LOCAL): {         
         uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);  
-        break;                     
+        slots[slot] = PEEK(0);  
+        DISPATCH();                     
       }
-      case OP_GET_GLOBAL: {                                     
-        ObjString* name = READ_STRING();                        
-        Value value;                                            
-        if (!tableGet(&vm.globals, name, &value)) {             
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;                       
+      CASE(OP_GET_LOCAL_LONG): PUSH(slots[READ_LONG()]); DISPATCH();
+      CASE(OP_SET_LOCAL_LONG): slots[READ_LONG()] = PEEK(0); DISPATCH();
+      CASE(OP_GET_GLOBAL_LONG):
+        index = READ_LONG();
+        goto getGlobalBody;
+      CASE(OP_GET_GLOBAL):
+        index = READ_SHORT();
+      getGlobalBody: {                                     
+        Value value = vm->globalValues.values[index];
+        if (IS_UNDEFINED(value)) {             
+          RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, index)->chars);
         }                                                       
-        push(value);                                            
-        break;                                                  
+        PUSH(value);                                            
+        DISPATCH();                                                  
       }
-      case OP_DEFINE_GLOBAL: {               
-        ObjString* name = READ_STRING();     
-        tableSet(&vm.globals, name, peek(0));
-        pop();                               
-        break;                               
-      }
-      case OP_SET_GLOBAL: {                                     
-        ObjString* name = READ_STRING();                        
-        if (tableSet(&vm.globals, name, peek(0))) {             
-          tableDelete(&vm.globals, name); 
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;                       
+      CASE(OP_DEFINE_GLOBAL_LONG):
+        index = READ_LONG();
+        goto defineGlobalBody;
+      CASE(OP_DEFINE_GLOBAL):
+        index = READ_SHORT();
+      defineGlobalBody:
+        vm->globalValues.values[index] = PEEK(0);
+        DROP();                               
+        DISPATCH();                               
+      CASE(OP_SET_GLOBAL_LONG):
+        index = READ_LONG();
+        goto setGlobalBody;
+      CASE(OP_SET_GLOBAL):
+        index = READ_SHORT();
+      setGlobalBody:
+        if (IS_UNDEFINED(vm->globalValues.values[index])) {             
+          RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, index)->chars);
         }                                                       
-        break;                                                  
-      } 
-      case OP_GET_UPVALUE: {                            
+        vm->globalValues.values[index] = PEEK(0);
+        DISPATCH();                                                  
+
+      CASE(OP_GET_UPVALUE): {                            
         uint8_t slot = READ_BYTE();                     
-        push(*frame->closure->upvalues[slot]->location);
-        break;                                          
+        PUSH(*frame->closure->upvalues[slot]->location);
+        DISPATCH();                                          
       }
-      case OP_SET_UPVALUE: {                                
+      CASE(OP_SET_UPVALUE): {                                
         uint8_t slot = READ_BYTE();                         
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;                                              
+        ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+        *upvalue->location = PEEK(0);
+        WRITE_BARRIER(vm, (Obj*)upvalue, PEEK(0));
+        DISPATCH();                                              
       }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {                      
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;                 
+      CASE(OP_GET_PROPERTY_LONG):
+        index = READ_LONG();
+        goto getPropertyBody;
+      CASE(OP_GET_LOCAL_GET_PROPERTY):
+        PUSH(slots[READ_BYTE()]);
+        // fall through, the name and cache operands follow as for OP_GET_PROPERTY
+      CASE(OP_GET_PROPERTY):
+        index = READ_BYTE();
+      getPropertyBody: {
+        if (!IS_INSTANCE(PEEK(0))) {                      
+          RUNTIME_ERROR("Only instances have properties.");
         } 
 
-        ObjInstance* instance = AS_INSTANCE(peek(0)); // read from stack
-        ObjString* name = READ_STRING(); // read from bytecode
+        ObjInstance* instance = AS_INSTANCE(PEEK(0)); // read from stack
+        ObjString* name = AS_STRING(CONSTANT(index)); // read from bytecode
+        InlineCache* cache = READ_CACHE();
 
-        Value value;                                        
-        if (tableGet(&instance->fields, name, &value)) {    
-          pop(); // Instance.                               
-          push(value);                                      
-          break;                                            
+        // a monomorphic field hit is handled right here
+        CacheEntry* cached = &cache->entries[0];
+        if (cache->count > 0 && cached->shape == instance->shape &&
+            cached->slot >= 0) {
+          PEEK(0) = instance->slots[cached->slot]; // Replace the instance.
+          DISPATCH();                                            
         }
 
-        if (!bindMethod(instance->klass, name)) {
+        STORE_FRAME();
+        if (!getProperty(vm, name, cache)) {
           return INTERPRET_RUNTIME_ERROR;        
         }                                        
-        break;                                               
+        LOAD_FRAME();
+        DISPATCH();                                               
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {                  
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;             
+      CASE(OP_SET_PROPERTY_LONG):
+        index = READ_LONG();
+        goto setPropertyBody;
+      CASE(OP_SET_PROPERTY):
+        index = READ_BYTE();
+      setPropertyBody: {
+        if (!IS_INSTANCE(PEEK(1))) {                  
+          RUNTIME_ERROR("Only instances have fields.");
         }                                 
         
-        ObjInstance* instance = AS_INSTANCE(peek(1));         
-        tableSet(&instance->fields, READ_STRING(), peek(0));
+        ObjInstance* instance = AS_INSTANCE(PEEK(1));         
+        ObjString* name = AS_STRING(CONSTANT(index));
+        InlineCache* cache = READ_CACHE();
+        CacheEntry* cached = findCacheEntry(cache, instance->shape);
+        if (cached != NULL && cached->transition == NULL) {
+          instance->slots[cached->slot] = PEEK(0);
+          WRITE_BARRIER(vm, (Obj*)instance, PEEK(0));
+        } else if (cached != NULL &&
+                   cached->slot < instance->slotCapacity) {
+          // adding the field only moves the instance along the shape tree
+          instance->slots[cached->slot] = PEEK(0);
+          instance->shape = cached->transition;
+          WRITE_BARRIER(vm, (Obj*)instance, PEEK(0));
+          WRITE_BARRIER(vm, (Obj*)instance, OBJ_VAL(instance->shape));
+        } else {
+          STORE_FRAME();
+          setProperty(vm, name, cache);
+        }
 
-        Value value = pop();                                  
-        pop();                                                
-        push(value);                                          
-        break;                                                
+        Value value = POP();                                  
+        DROP();                                                
+        PUSH(value);                                          
+        DISPATCH();                                                
       }
-      case OP_GET_SUPER: {                     
-        ObjString* name = READ_STRING();       
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!bindMethod(superclass, name)) {   
+      CASE(OP_GET_SUPER_LONG):
+        index = READ_LONG();
+        goto getSuperBody;
+      CASE(OP_GET_SUPER):
+        index = READ_BYTE();
+      getSuperBody: {                     
+        ObjString* name = AS_STRING(CONSTANT(index));
+        // the compiler only puts a class here, a loaded file might not
+        if (!IS_CLASS(PEEK(0))) RUNTIME_ERROR("Superclass must be a class.");
+        ObjClass* superclass = AS_CLASS(POP());
+        STORE_FRAME();
+        if (!bindMethod(vm, superclass, name)) {   
           return INTERPRET_RUNTIME_ERROR;      
         }                                      
-        break;                                 
+        LOAD_FRAME();
+        DISPATCH();                                 
+      }
+      CASE(OP_EQUAL): {                                  
+        if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) {
+          STORE_FRAME();
+          flattenOperand(vm, 0);
+          flattenOperand(vm, 1);
+          LOAD_FRAME();
+        }
+        Value b = POP();                                
+        Value a = POP();                                
+        PUSH(BOOL_VAL(valuesEqual(a, b)));              
+        DISPATCH();                                          
       }
-      case OP_EQUAL: {                                  
-        Value b = pop();                                
-        Value a = pop();                                
-        push(BOOL_VAL(valuesEqual(a, b)));              
-        break;                                          
+      CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();  
+      CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+      CASE(OP_ADD_CONST): {
+        Value constant = READ_CONSTANT();
+        if (IS_NUMBER(PEEK(0)) && IS_NUMBER(constant)) {
+          PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(constant));
+          DISPATCH();
+        }
+        // strings and type errors fall through to OP_ADD
+        PUSH(constant);
       }
-      case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;  
-      case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-      case OP_ADD: {                                                   
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {                
-          concatenate();                                               
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {         
-          double b = AS_NUMBER(pop());                                 
-          double a = AS_NUMBER(pop());                                 
-          push(NUMBER_VAL(a + b));                                     
+      CASE(OP_ADD): {                                                   
+        if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1))) {                
+          STORE_FRAME();
+          concatenate(vm);                                               
+          LOAD_FRAME();
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {         
+          double b = AS_NUMBER(POP());                                 
+          double a = AS_NUMBER(POP());                                 
+          PUSH(NUMBER_VAL(a + b));                                     
         } else {                                                       
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;                              
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
         }                                                              
-        break;                                                         
+        DISPATCH();                                                         
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT:                                      
-        push(BOOL_VAL(isFalsey(pop())));                
-        break;
-      case OP_NEGATE:                               
-        if (!IS_NUMBER(peek(0))) {                  
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;           
+      CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+      CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+      CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+      CASE(OP_NOT):                                      
+        PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));                
+        DISPATCH();
+      CASE(OP_NEGATE):                               
+        if (!IS_NUMBER(PEEK(0))) {                  
+          RUNTIME_ERROR("Operand must be a number.");
         }
 
-        push(NUMBER_VAL(-AS_NUMBER(pop())));        
-        break;
-      case OP_PRINT: {    
-        printValue(pop());
-        printf("\n");     
-        break;            
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));        
+        DISPATCH();
+      CASE(OP_PRINT): {    
+        if (IS_ROPE(PEEK(0))) {
+          STORE_FRAME();
+          flattenOperand(vm, 0);
+          LOAD_FRAME();
+        }
+        fprintValue(vm->output, POP());
+        fputc('\n', vm->output);
+        DISPATCH();            
       }
-      case OP_JUMP: {                  
+      CASE(OP_JUMP): {                  
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;               
-        break;                         
+        ip += offset;               
+        DISPATCH();                         
       }
-      case OP_JUMP_IF_FALSE: {                 
+      CASE(OP_JUMP_IF_FALSE): {                 
         uint16_t offset = READ_SHORT();        
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;                                 
+        if (isFalsey(PEEK(0))) ip += offset;
+        DISPATCH();                                 
       }
-      case OP_LOOP: {                  
+      CASE(OP_LOOP): {                  
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;               
-        break;                         
+        ip -= offset;               
+        DISPATCH();                         
       } 
-      case OP_CALL: {                              
+      CASE(OP_CALL): {                              
         int argCount = READ_BYTE();                
-        if (!callValue(peek(argCount), argCount)) {
+        STORE_FRAME();
+        if (!callValue(vm, PEEK(argCount), argCount)) {
           // the first slot of the substack is peek(argCount) = callee
           // and it is only used to correctly invoking callValue
           // so after that it can be changed to this if callee is a method
           return INTERPRET_RUNTIME_ERROR;          
         }
-        frame = &vm.frames[vm.frameCount - 1];                                          
-        break;                                     
+        LOAD_FRAME();
+        DISPATCH();                                     
       }
-      case OP_INVOKE: {                       
-        ObjString* method = READ_STRING();    
+      CASE(OP_INVOKE_LONG):
+        index = READ_LONG();
+        goto invokeBody;
+      CASE(OP_INVOKE):
+        index = READ_BYTE();
+      invokeBody: {                       
+        ObjString* method = AS_STRING(CONSTANT(index));
         int argCount = READ_BYTE();           
-        if (!invoke(method, argCount)) {      
+        InlineCache* cache = READ_CACHE();
+        STORE_FRAME();
+        if (!invoke(vm, method, argCount, cache)) {      
           return INTERPRET_RUNTIME_ERROR;     
         }                                     
-        frame = &vm.frames[vm.frameCount - 1];
-        break;                                
+        LOAD_FRAME();
+        DISPATCH();                                
       }
-      case OP_SUPER_INVOKE: {                                
-        ObjString* method = READ_STRING();                   
+      CASE(OP_SUPER_INVOKE_LONG):
+        index = READ_LONG();
+        goto superInvokeBody;
+      CASE(OP_SUPER_INVOKE):
+        index = READ_BYTE();
+      superInvokeBody: {                                
+        ObjString* method = AS_STRING(CONSTANT(index));
         int argCount = READ_BYTE();                          
-        ObjClass* superclass = AS_CLASS(pop());              
-        if (!invokeFromClass(superclass, method, argCount)) {
+        if (!IS_CLASS(PEEK(0))) RUNTIME_ERROR("Superclass must be a class.");
+        ObjClass* superclass = AS_CLASS(POP());              
+        STORE_FRAME();
+        if (!invokeFromClass(vm, superclass, method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;                    
         }                                                    
-        frame = &vm.frames[vm.frameCount - 1];               
-        break;                                               
+        LOAD_FRAME();               
+        DISPATCH();                                               
       }
-      case OP_CLOSURE: {                                     
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);          
-        push(OBJ_VAL(closure));
+      CASE(OP_CLOSURE_LONG):
+        index = READ_LONG();
+        goto closureBody;
+      CASE(OP_CLOSURE):
+        index = READ_BYTE();
+      closureBody: {                                     
+        ObjFunction* function = AS_FUNCTION(CONSTANT(index));
+        STORE_FRAME();
+        ObjClosure* closure = newClosure(vm, function);          
+        PUSH(OBJ_VAL(closure));
+        // captureUpvalue allocates, so the closure must be visible to the gc
+        vm->stackTop = stackTop;
         // upvalues get captured when function closure is declared
         for (int i = 0; i < closure->upvalueCount; i++) {               
-          uint8_t isLocal = READ_BYTE();                                
-          uint8_t index = READ_BYTE();                                  
-          if (isLocal) {                                                
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+          uint8_t kind = READ_BYTE();
+          uint32_t index = kind == CAPTURE_LOCAL_LONG ? READ_LONG()
+                                                      : READ_BYTE();
+          if (kind != CAPTURE_UPVALUE) {                                                
+            closure->upvalues[i] = captureUpvalue(vm, slots + index);
           } else {     
             // if the upvalue is a local variable of grand parent function
             // it should already be captured when parent function get declared
@@ -519,76 +1193,228 @@ static InterpretResult run() {
             // so it's safe to just =        
             closure->upvalues[i] = frame->closure->upvalues[index];     
           }                                                             
+          // capturing may have run a gc that promoted the closure
+          WRITE_BARRIER(vm, (Obj*)closure, OBJ_VAL(closure->upvalues[i]));
         }                              
-        break;                                               
+        DISPATCH();                                               
       }
-      case OP_CLOSE_UPVALUE: {
+      CASE(OP_CLOSE_UPVALUE): {
         // emitted from endScope, will be used for upvalues for loop and block
         // it's doing similar things as the start of OP_RETURN
         // except that we don't have the start of locals for this scope
-        // so we cannot just reassign vm.stackTop = frame->slots;
-        // we need to do it one step at a time, only at location vm.stackTop-1
-        closeUpvalues(vm.stackTop - 1);
-        pop();                         
-        break;
+        // so we cannot just reassign stackTop = slots;
+        // we need to do it one step at a time, only at location stackTop-1
+        closeUpvalues(vm, stackTop - 1);
+        DROP();                         
+        DISPATCH();
       }
-      case OP_RETURN: {
-        Value result = pop();
+      CASE(OP_RETURN): {
+        Value result = POP();
         // when inner function closure get declared
         // related upvalues should already be appended to vm.openUpvalues
-        // and they should all be local variables of outer function, so we use frame->slots as last
-        closeUpvalues(frame->slots);
-        vm.frameCount--;                      
-        if (vm.frameCount == 0) {             
-          pop();                              
-          return INTERPRET_OK;                
-        }                                     
-
-        vm.stackTop = frame->slots;           
-        push(result);                         
+        // and they should all be local variables of outer function, so we use slots as last
+        closeUpvalues(vm, slots);
+        vm->frameCount--;                      
+        stackTop = slots;           
+        PUSH(result);                         
 
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        vm->stackTop = stackTop;
+        if (vm->frameCount == 0) {
+          // the outermost call leaves its result for callFunction()
+          if (vm->fiber == vm->mainFiber) return INTERPRET_OK;
+          // that of a fiber is what resume() returns
+          endFiber(vm);
+          push(vm, result);
+        }
+        LOAD_FRAME();
+        DISPATCH();
       }
 
-      case OP_CLASS:                           
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
-      case OP_INHERIT: {                                                
-        Value superclass = peek(1);
+      CASE(OP_CLASS_LONG):
+        index = READ_LONG();
+        goto classBody;
+      CASE(OP_CLASS):
+        index = READ_BYTE();
+      classBody: {                         
+        ObjString* name = AS_STRING(CONSTANT(index));
+        STORE_FRAME();
+        PUSH(OBJ_VAL(newClass(vm, name)));
+        DISPATCH();
+      }
+      CASE(OP_INHERIT): {                                                
+        Value superclass = PEEK(1);
         if (!IS_CLASS(superclass)) {                                    
-          runtimeError("Superclass must be a class.");                  
-          return INTERPRET_RUNTIME_ERROR;                               
+          RUNTIME_ERROR("Superclass must be a class.");                  
         }                                     
-        ObjClass* subclass = AS_CLASS(peek(0));                         
-        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-        pop(); // only pop subclass, so superclass is still on stackTop, to behave as a local variable in outer scope
-        break;                                                          
+        if (!IS_CLASS(PEEK(0))) RUNTIME_ERROR("Only a class can inherit.");
+        ObjClass* subclass = AS_CLASS(PEEK(0));                         
+        STORE_FRAME();
+        tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+        rememberObject(vm, (Obj*)subclass);
+        DROP(); // only pop subclass, so superclass is still on stackTop, to behave as a local variable in outer scope
+        DISPATCH();                                                          
       }
-      case OP_METHOD:               
-        defineMethod(READ_STRING());
-        break;                                
+      CASE(OP_METHOD_LONG):
+        index = READ_LONG();
+        goto methodBody;
+      CASE(OP_METHOD):
+        index = READ_BYTE();
+      methodBody: {             
+        // every method is a closure on a class, whatever the file says
+        if (!IS_CLASS(PEEK(1)) || !IS_CLOSURE(PEEK(0))) {
+          RUNTIME_ERROR("Methods are functions defined on a class.");
+        }
+        ObjString* name = AS_STRING(CONSTANT(index));
+        STORE_FRAME();
+        defineMethod(vm, name);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(OP_ADD_LOCAL_CONST): {
+        uint8_t slot = READ_BYTE();
+        Value constant = READ_CONSTANT();
+        if (IS_NUMBER(slots[slot]) && IS_NUMBER(constant)) {
+          slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) +
+                                   AS_NUMBER(constant));
+        } else if (IS_TEXT(slots[slot]) && IS_STRING(constant)) {
+          PUSH(slots[slot]);
+          PUSH(constant);
+          STORE_FRAME();
+          concatenate(vm);
+          LOAD_FRAME();
+          slots[slot] = POP();
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        DISPATCH();
+      }
+      CASE(OP_LESS_JUMP_IF_FALSE):    COMPARE_JUMP(<); DISPATCH();
+      CASE(OP_GREATER_JUMP_IF_FALSE): COMPARE_JUMP(>); DISPATCH();                                
+#ifndef COMPUTED_GOTO
     }                                   
   }                                     
+#endif
 
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
+#undef CONSTANT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef RUNTIME_ERROR
 #undef BINARY_OP                          
+#undef COMPARE_JUMP
+#undef TRACE_EXECUTION
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);             
+InterpretResult interpret(VM* vm, const char* source) {
+  ObjFunction* function = compile(vm, source);             
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
   // current now point to NULL not function
   // so nothing to track it, have to push to the stack
-  push(OBJ_VAL(function));
-  ObjClosure* closure = newClosure(function);          
-  pop();                                               
-  push(OBJ_VAL(closure));                              
-  callValue(OBJ_VAL(closure), 0);                
+  push(vm, OBJ_VAL(function));
+  ObjClosure* closure = newClosure(vm, function);          
+  pop(vm);                                               
+  return runScript(vm, closure);
+}
+
+void resetVM(VM* vm) {
+  resetStack(vm);
+  for (int i = 0; i < vm->globalValues.count; i++) {
+    vm->globalValues.values[i] = UNDEFINED_VAL;
+  }
+
+  // a script may have assigned over a native, so all are put back
+  for (int i = 0; i < vm->natives.capacity; i++) {
+    Entry* entry = &vm->natives.entries[i];
+    if (entry->key == NULL) continue;
+    Value slot;
+    tableGet(&vm->globalNames, entry->key, &slot);
+    vm->globalValues.values[(int)AS_NUMBER(slot)] = entry->value;
+  }
+}
+
+ObjClosure* loadScript(VM* vm, const char* name, const char* source) {
+  ObjFunction* function = compile(vm, source);
+  if (function == NULL) return NULL;
+  return holdScript(vm, name, function);
+}
+
+ObjClosure* holdScript(VM* vm, const char* name, ObjFunction* function) {
+  push(vm, OBJ_VAL(function));
+  ObjClosure* script = newClosure(vm, function);
+  push(vm, OBJ_VAL(script));
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  tableSet(vm, &vm->scripts, AS_STRING(peek(vm, 0)), OBJ_VAL(script));
+  pop(vm);
+  pop(vm);
+  pop(vm);
+  return script;
+}
+
+static Value findName(Table* table, const char* name) {
+  // looked up without allocating, so any value already held stays safe
+  int length = (int)strlen(name);
+  ObjString* key = tableFindString(table, name, length,
+                                   hashString(name, length));
+  Value value;
+  if (key == NULL || !tableGet(table, key, &value)) return UNDEFINED_VAL;
+  return value;
+}
+
+ObjClosure* findScript(VM* vm, const char* name) {
+  Value script = findName(&vm->scripts, name);
+  return IS_UNDEFINED(script) ? NULL : AS_CLOSURE(script);
+}
+
+InterpretResult runScript(VM* vm, ObjClosure* script) {
+  Value result;
+  push(vm, OBJ_VAL(script));
+  return callFunction(vm, 0, &result);
+}
+
+bool getGlobal(VM* vm, const char* name, Value* value) {
+  Value slot = findName(&vm->globalNames, name);
+  if (IS_UNDEFINED(slot)) return false;
+
+  *value = vm->globalValues.values[(int)AS_NUMBER(slot)];
+  return !IS_UNDEFINED(*value);
+}
+
+InterpretResult callFunction(VM* vm, int argCount, Value* result) {
+  // run() returns when the frame count drops to zero, from inside a
+  // native it would return into the middle of the running script
+  if (vm->frameCount != 0) {
+    fprintf(vm->errors, "Cannot call lox from a native function.\n");
+    vm->stackTop -= argCount + 1;
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  if (!callValue(vm, vm->stackTop[-argCount - 1], argCount)) {
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  // natives and classes without an initializer have returned already
+  if (vm->frameCount > 0) {
+    InterpretResult status = run(vm);
+    if (status != INTERPRET_OK) return status;
+  }
 
-  return run();                     
+  // ropes never leave the vm, the embedder gets the string
+  flattenOperand(vm, 0);
+  *result = pop(vm);
+  return INTERPRET_OK;
 }
\ No newline at end of file
@@ -1,14 +1,25 @@
 #ifndef clox_vm_h 
 #define clox_vm_h 
 
+#include "memory.h"
 #include "object.h"
+#include "program.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64                       
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// no lox value is an object at NULL
+#define UNDEFINED_VAL OBJ_VAL(NULL)
+#define IS_UNDEFINED(value) (IS_OBJ(value) && AS_OBJ(value) == NULL)
 
-typedef struct {
+// both stacks start at these sizes and double when a call needs more
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+// a call nested deeper than this is a stack overflow
+#define FRAMES_MAX (1024 * 1024)
+// a fiber starts with room for a few calls, then grows like the vm
+#define FIBER_FRAMES_INITIAL 4
+
+typedef struct sCallFrame {
   // contains the function and its execution environment      
   ObjClosure* closure;
   // cpu: ip starts from function->chunk->code
@@ -18,25 +29,72 @@ typedef struct {
   Value* slots;
 } CallFrame;
 
-typedef struct {  
-  CallFrame frames[FRAMES_MAX];
+typedef enum {
+  GC_IDLE,
+  GC_MARKING, // only with GC_INCREMENTAL
+  GC_SWEEPING // only with GC_INCREMENTAL
+} GCPhase;
+
+// the state of one interpreter: its heap, stacks and globals
+// nothing is shared between VMs, so each may run on its own thread
+struct sVM {  
+  CallFrame* frames;
   int frameCount;
+  int frameCapacity;
 
-  Value stack[STACK_MAX];
+  // growing moves the stack, see growStack() for what points into it
+  Value* stack;
   Value* stackTop;
-  Table globals;
+  int stackCapacity;
+  // the compiler gives every global name a slot in globalValues,
+  // so globals are read and written by index at run time
+  Table globalNames;       // name -> NUMBER_VAL(slot)
+  ValueArray globalValues; // UNDEFINED_VAL until the global is defined
   Table strings;
   ObjString* initString; // constant string of "init", used everywhere for inheritance, so store it here
   ObjUpvalue* openUpvalues;
+  // the stacks above are those of this fiber, see switchFiber()
+  ObjFiber* fiber;
+  ObjFiber* mainFiber; // runs the scripts and callFunction()
+  ObjFiber* nextFiber; // set by resume() and yield() to switch to
+  // the compile in progress, its unfinished functions are gc roots
+  struct sParser* parser;
+  Table scripts; // name -> closure, see loadScript()
+  Table natives; // name -> native, put back by resetVM()
+  // the inline caches of the frozen functions this vm runs, see Program
+  InlineCache* sharedCaches;
+  int sharedCacheCount;
+  // where print statements and error messages go, stdout and stderr
+  // unless the embedder sets them after initVM()
+  FILE* output;
+  FILE* errors;
+
+  // free blocks of POOL_GRANULE * (i + 1) bytes, carved out of pages
+  PoolBlock* freeBlocks[POOL_CLASSES];
+  PoolPage* pages;
 
   // gc related
   size_t bytesAllocated;   
   size_t nextGC;
-  Obj* objects; // linked-list of all objects to feed to gc
+  size_t nurseryBytes; // allocated since the last collection, triggers minor gcs
+  bool minorGC;        // a minor gc is running
+  Obj* objects; // linked-list of all objects to feed to gc, young ones in front
   int grayCount;   
   int grayCapacity;
   Obj** grayStack;   
-} VM;
+  // old objects written with a pointer to a young one since the last gc
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+  // progress of an incremental full collection
+  GCPhase gcPhase;
+  Obj* sweepList;  // objects that existed when marking finished
+  Obj** sweepLink; // next link of sweepList to look at
+#ifdef DEBUG_GC_STATS
+  int gcPauses;
+  double gcMaxPause; // seconds
+#endif
+};
 
 typedef enum {            
   INTERPRET_OK,           
@@ -44,12 +102,39 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR 
 } InterpretResult; 
 
-extern VM vm;
-
-void initVM();    
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);                 
-Value pop();    
+void initVM(VM* vm);    
+// like initVM(), for a vm that runs the frozen functions of program:
+// its strings are interned and its globals take their slots before
+// anything else, as in the vm the program was frozen from
+void initSharedVM(VM* vm, Program* program);
+void freeVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+// runs a script compiled earlier, e.g. loaded from bytecode
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+// ready for another script: the stacks are emptied and every global but
+// the natives is undefined, while the heap, the interned strings and the
+// scripts held by the vm are kept for it
+void resetVM(VM* vm);
+// embedding: compile a script once, run it to define its functions, then
+// call those from c as often as needed, see bench/embedbench.c
+// scripts are held by name until freeVM(), another script loaded under
+// the same name replaces the one held before
+ObjClosure* loadScript(VM* vm, const char* name, const char* source);
+ObjClosure* holdScript(VM* vm, const char* name, ObjFunction* function);
+// NULL if nothing is held under that name
+ObjClosure* findScript(VM* vm, const char* name);
+InterpretResult runScript(VM* vm, ObjClosure* script);
+// arity is checked on every call, -1 accepts any number of arguments
+void defineNative(VM* vm, const char* name, int arity, NativeFn function);
+// false if no global of that name has been defined
+bool getGlobal(VM* vm, const char* name, Value* value);
+// calls the value argCount slots below the top of the stack with the
+// arguments pushed after it, pops both and stores what it returned;
+// only from outside a running script, as a native cannot call back into lox
+InterpretResult callFunction(VM* vm, int argCount, Value* result);
+int globalSlot(VM* vm, ObjString* name);
+ObjString* globalName(VM* vm, int slot);
+void push(VM* vm, Value value);                 
+Value pop(VM* vm);    
 
 #endif  
\ No newline at end of file